@@ -1,5 +1,6 @@
 from setuptools import setup, Extension
 from setuptools.command.build_ext import build_ext
+import os
 import sys
 import setuptools
 
@@ -69,11 +70,11 @@ class BuildExt(build_ext):
     """A custom build extension for adding compiler-specific options."""
     c_opts = {
         'msvc': ['/EHsc'],
-        'unix': [],
+        'unix': ['-pthread'],
     }
     l_opts = {
         'msvc': [],
-        'unix': ['-lcurl', '-lz'],
+        'unix': ['-lcurl', '-lz', '-pthread'],
     }
 
     if sys.platform == 'darwin':
@@ -92,6 +93,20 @@ class BuildExt(build_ext):
                 opts.append('-fvisibility=hidden')
         elif ct == 'msvc':
             opts.append('/DVERSION_INFO=\\"%s\\"' % self.distribution.get_version())
+        # STRAW_INFLATE=libdeflate builds against libdeflate instead of zlib
+        if ct == 'unix' and os.environ.get('STRAW_INFLATE') == 'libdeflate':
+            opts = opts + ['-DSTRAW_USE_LIBDEFLATE']
+            link_opts = [o for o in link_opts if o != '-lz'] + ['-ldeflate']
+        # STRAW_HDF5=1 links HDF5 so exportPixels can write .cool files; STRAW_HDF5=serial uses the
+        # Debian/Ubuntu serial build (/usr/include/hdf5/serial, libhdf5_serial)
+        hdf5 = os.environ.get('STRAW_HDF5')
+        if ct == 'unix' and hdf5:
+            opts = opts + ['-DSTRAW_USE_HDF5']
+            if hdf5 == 'serial':
+                opts = opts + ['-I/usr/include/hdf5/serial']
+                link_opts = link_opts + ['-lhdf5_serial']
+            else:
+                link_opts = link_opts + ['-lhdf5']
         for ext in self.extensions:
             ext.extra_compile_args = opts
             ext.extra_link_args = link_opts
@@ -106,7 +121,7 @@ setup(
     description='Straw bound with pybind11',
     long_description='',
     ext_modules=ext_modules,
-    install_requires=['pybind11>=2.4'],
+    install_requires=['pybind11>=2.4', 'numpy'],
     setup_requires=['pybind11>=2.4'],
     python_requires='>3.3',
     cmdclass={'build_ext': BuildExt},
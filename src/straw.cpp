@@ -22,19 +22,49 @@
  THE SOFTWARE.
 */
 #include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <cmath>
 #include <set>
 #include <vector>
 #include <streambuf>
+#include <numeric>
+#include <atomic>
+#include <limits>
+#include <queue>
+#include <ctime>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define STRAW_X86_SIMD
+#include <immintrin.h>
+#endif
 #include <curl/curl.h>
+#ifdef STRAW_USE_LIBDEFLATE
+#include <libdeflate.h>
+#else
 #include "zlib.h"
+#endif
+#ifdef STRAW_USE_HDF5
+#include <hdf5.h>
+#endif
 #include "straw.h"
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
 using namespace std;
 
 /*
@@ -46,97 +76,77 @@ using namespace std;
 
   Usage: straw <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize> 
  */
-// this is for creating a stream from a byte array for ease of use
+// this is for creating a stream from a byte array for ease of use; seekable, so a
+// memory-mapped file can be read through the same istream code as an ifstream
 struct membuf : std::streambuf {
     membuf(char *begin, char *end) {
         this->setg(begin, begin, end);
     }
-};
-
-// for holding data from URL call
-struct MemoryStruct {
-    char *memory;
-    size_t size;
-};
 
-// version number
-int version;
-
-// map of block numbers to pointers
-
-
-long total_bytes;
-
-size_t hdf(char* b, size_t size, size_t nitems, void *userdata) {
-    size_t numbytes = size * nitems;
-    b[numbytes + 1] = '\0';
-    string s(b);
-    int found = s.find("Content-Range");
-    if (found != string::npos) {
-        int found2 = s.find("/");
-        //Content-Range: bytes 0-100000/891471462
-        if (found2 != string::npos) {
-            string total = s.substr(found2 + 1);
-            total_bytes = stol(total);
-        }
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        char *target = dir == std::ios_base::beg ? eback() + off : dir == std::ios_base::cur ? gptr() + off : egptr() + off;
+        if (target < eback() || target > egptr()) return pos_type(off_type(-1));
+        setg(eback(), target, egptr());
+        return pos_type(target - eback());
     }
 
-    return numbytes;
-}
-
-// callback for libcurl. data written to this buffer
-static size_t
-WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *) userp;
-
-    mem->memory = static_cast<char *>(realloc(mem->memory, mem->size + realsize + 1));
-    if (mem->memory == NULL) {
-        /* out of memory! */
-        printf("not enough memory (realloc returned NULL)\n");
-        return 0;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
     }
+};
 
-    std::memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
-
-    return realsize;
-}
-
-// get a buffer that can be used as an input stream from the URL
-char *getData(CURL *curl, long position, long chunksize) {
-    std::ostringstream oss;
-    struct MemoryStruct chunk;
-
-    chunk.memory = static_cast<char *>(malloc(1));
-    chunk.size = 0;    /* no data at this point */
-    oss << position << "-" << position + chunksize;
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &chunk);
-    curl_easy_setopt(curl, CURLOPT_RANGE, oss.str().c_str());
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n",
-                curl_easy_strerror(res));
+static const long minRangeWindow = 64 * 1024;
+static const long maxRangeWindow = 16 * 1024 * 1024;
+
+// a seekable stream over the bytes [begin, end) of a remote file that fetches a window only once
+// the reader gets to it, so seeking over a section transfers nothing; windows double while
+// reading runs on, so a long section takes a few requests rather than one per window. the stream
+// also stops at the end of the file, which for the header is only known once the first response is in
+struct rangebuf : std::streambuf {
+    rangebuf(HttpFetcher &http, long begin, long end)
+            : http(http), begin(begin), end(end), start(begin), window(minRangeWindow) {}
+
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        long position = start + (gptr() - eback());
+        window = eback() ? min(window * 2, maxRangeWindow) : minRangeWindow;
+        long size = min(window, end - position);
+        if (size <= 0) return traits_type::eof();
+        data = http.fetch(position, size);
+        if (!data) return traits_type::eof();
+        // a window that ran past the end of the file has nothing after it
+        if (http.getTotalBytes() > 0) size = min(size, http.getTotalBytes() - position);
+        if (size <= 0) return traits_type::eof();
+        start = position;
+        setg(data.get(), data.get(), data.get() + size);
+        return traits_type::to_int_type(*gptr());
     }
-    //  printf("%lu bytes retrieved\n", (long)chunk.size);
 
-    return chunk.memory;
-}
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        long position = start + (gptr() - eback());
+        long target = dir == std::ios_base::beg ? begin + off : dir == std::ios_base::cur ? position + off : end + off;
+        if (target < begin || target > end) return pos_type(off_type(-1));
+        if (eback() && target >= start && target <= start + (egptr() - eback())) {
+            setg(eback(), eback() + (target - start), egptr());
+        } else {
+            data.reset();
+            setg(NULL, NULL, NULL);
+            start = target;
+        }
+        return pos_type(target - begin);
+    }
 
-// initialize the CURL stream
-CURL* initCURL(const char* url) {
-    CURL *curl = curl_easy_init();
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        //curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, hdf);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "straw");
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
     }
-    return curl;
-}
+
+    HttpFetcher &http;
+    long begin, end;
+    // file position of eback()
+    long start;
+    long window;
+    shared_ptr<char> data;
+};
 
 // returns whether or not this is valid HiC file
 bool readMagicString(istream &fin) {
@@ -145,18 +155,6 @@ bool readMagicString(istream &fin) {
     return str[0] == 'H' && str[1] == 'I' && str[2] == 'C';
 }
 
-char readCharFromFile(istream &fin) {
-    char tempChar;
-    fin.read((char *) &tempChar, sizeof(char));
-    return tempChar;
-}
-
-short readShortFromFile(istream &fin) {
-    short tempShort;
-    fin.read((char *) &tempShort, sizeof(short));
-    return tempShort;
-}
-
 int readIntFromFile(istream &fin) {
     int tempInt;
     fin.read((char *) &tempInt, sizeof(int));
@@ -182,8 +180,17 @@ double readDoubleFromFile(istream &fin) {
 }
 
 // reads the header, storing the positions of the normalization vectors and returning the masterIndexPosition pointer
-map<string, chromosome> readHeader(istream &fin, long &masterIndexPosition) {
+map<string, chromosome> readHeader(istream &fin, long &masterIndexPosition, int &version) {
+    long nviPosition, nviLength;
+    return readHeader(fin, masterIndexPosition, version, nviPosition, nviLength);
+}
+
+// as above, also returning where the norm vector index is (v9 only; -1 for earlier versions)
+map<string, chromosome> readHeader(istream &fin, long &masterIndexPosition, int &version, long &nviPosition,
+                                   long &nviLength) {
     map<string, chromosome> chromosomeMap;
+    nviPosition = -1;
+    nviLength = -1;
     if (!readMagicString(fin)) {
         cerr << "Hi-C magic string is missing, does not appear to be a hic file" << endl;
         masterIndexPosition = -1;
@@ -201,8 +208,8 @@ map<string, chromosome> readHeader(istream &fin, long &masterIndexPosition) {
     getline(fin, genomeID, '\0');
 
     if (version > 8) {
-        long nviPosition = readLongFromFile(fin);
-        long nviLength = readLongFromFile(fin);
+        nviPosition = readLongFromFile(fin);
+        nviLength = readLongFromFile(fin);
     }
 
     int nattributes = readIntFromFile(fin);
@@ -234,115 +241,63 @@ map<string, chromosome> readHeader(istream &fin, long &masterIndexPosition) {
     return chromosomeMap;
 }
 
-// reads the footer from the master pointer location. takes in the chromosomes,
-// norm, unit (BP or FRAG) and resolution or binsize, and sets the file 
-// position of the matrix and the normalization vectors for those chromosomes 
-// at the given normalization and resolution
-bool readFooter(istream& fin, long master, int c1, int c2, string norm, string unit, int resolution, long &myFilePos, indexEntry &c1NormEntry, indexEntry &c2NormEntry) {
+// key under which a normalization vector is stored in the normalization vector index
+string getNormKey(const string &norm, int chrIdx, const string &unit, int resolution) {
+    stringstream ss;
+    ss << norm << "_" << chrIdx << "_" << unit << "_" << resolution;
+    return ss.str();
+}
+
+// key under which an expected value vector is stored in the expected value index
+string getExpectedKey(const string &norm, const string &unit, int resolution) {
+    stringstream ss;
+    ss << norm << "_" << unit << "_" << resolution;
+    return ss.str();
+}
+
+// seeks over the rest of an expected value map entry, from its bin size on: the expected
+// values (float in v9, double before) and the per-chromosome normalization factors
+void skipExpectedValues(istream &fin, int version) {
+    readIntFromFile(fin); // binSize
+    long valueSize = version > 8 ? sizeof(float) : sizeof(double);
+    long nValues = version > 8 ? readLongFromFile(fin) : (long) readIntFromFile(fin);
+    if (nValues < 0) fin.setstate(ios::failbit);
+    fin.seekg(nValues * valueSize, ios::cur);
+    int nNormalizationFactors = readIntFromFile(fin);
+    if (nNormalizationFactors < 0) fin.setstate(ios::failbit);
+    fin.seekg(nNormalizationFactors * (sizeof(int) + valueSize), ios::cur);
+}
+
+// reads the master index at the start of the footer, storing the file position of every
+// chr_chr matrix in masterIndex
+bool readMasterIndex(istream &fin, int version, unordered_map<string, indexEntry> &masterIndex) {
     if (version > 8) {
         long nBytes = readLongFromFile(fin);
     } else {
         int nBytes = readIntFromFile(fin);
     }
 
-    stringstream ss;
-    ss << c1 << "_" << c2;
-    string key = ss.str();
-
     int nEntries = readIntFromFile(fin);
-    bool found = false;
     for (int i = 0; i < nEntries; i++) {
         string str;
         getline(fin, str, '\0');
-        long fpos = readLongFromFile(fin);
-        int sizeinbytes = readIntFromFile(fin);
-        if (str == key) {
-            myFilePos = fpos;
-            found = true;
-        }
+        indexEntry entry;
+        entry.position = readLongFromFile(fin);
+        entry.size = (long) readIntFromFile(fin);
+        masterIndex[str] = entry;
     }
-    if (!found) {
-        cerr << "File doesn't have the given chr_chr map " << key << endl;
+    if (!fin) {
+        cerr << "Could not read the master index" << endl;
         return false;
     }
+    return true;
+}
 
-    if (norm == "NONE") return true; // no need to read norm vector index
-
-    // read in and ignore expected value maps; don't store; reading these to
-    // get to norm vector index
-    int nExpectedValues = readIntFromFile(fin);
-    for (int i = 0; i < nExpectedValues; i++) {
-        string str;
-        getline(fin, str, '\0'); //unit
-        int binSize = readIntFromFile(fin);
-
-        long nValues;
-        if (version > 8) {
-            fin.read((char *) &nValues, sizeof(long));
-        } else {
-            nValues = (long) readIntFromFile(fin);
-        }
-
-        if (version > 8) {
-            for (long j = 0; j < nValues; j++) {
-                readFloatFromFile(fin);
-            }
-        } else {
-            for (int j = 0; j < nValues; j++) {
-                readDoubleFromFile(fin);
-            }
-        }
-
-        int nNormalizationFactors = readIntFromFile(fin);
-        for (int j = 0; j < nNormalizationFactors; j++) {
-            int chrIdx = readIntFromFile(fin);
-            if (version > 8) {
-                readFloatFromFile(fin);
-            } else {
-                readDoubleFromFile(fin);
-            }
-        }
-    }
-
-    nExpectedValues = readIntFromFile(fin);
-    for (int i = 0; i < nExpectedValues; i++) {
-        string str, str2;
-        getline(fin, str, '\0'); //typeString
-        getline(fin, str2, '\0'); //unit
-        int binSize = readIntFromFile(fin);
-
-        long nValues;
-        if (version > 8) {
-            fin.read((char *) &nValues, sizeof(long));
-        } else {
-            nValues = (long) readIntFromFile(fin);
-        }
-
-        if (version > 8) {
-            for (long j = 0; j < nValues; j++) {
-                readFloatFromFile(fin);
-            }
-        } else {
-            for (int j = 0; j < nValues; j++) {
-                readDoubleFromFile(fin);
-            }
-        }
-
-        int nNormalizationFactors = readIntFromFile(fin);
-        for (int j = 0; j < nNormalizationFactors; j++) {
-            int chrIdx = readIntFromFile(fin);
-            if (version > 8) {
-                readFloatFromFile(fin);
-            } else {
-                readDoubleFromFile(fin);
-            }
-        }
-    }
-
-    // Index of normalization vectors
-    nEntries = readIntFromFile(fin);
-    bool found1 = false;
-    bool found2 = false;
+// reads the index of normalization vectors, storing the position of every normalization vector
+// in normVectorIndex, keyed by getNormKey; files without normalization have no index
+bool readNormVectorIndex(istream &fin, int version, unordered_map<string, indexEntry> &normVectorIndex) {
+    int nEntries = readIntFromFile(fin);
+    if (!fin) return true;
     for (int i = 0; i < nEntries; i++) {
         string normtype;
         getline(fin, normtype, '\0'); //normalization type
@@ -358,561 +313,1760 @@ bool readFooter(istream& fin, long master, int c1, int c2, string norm, string u
             sizeInBytes = (long) readIntFromFile(fin);
         }
 
-        if (chrIdx == c1 && normtype == norm && unit1 == unit && resolution1 == resolution) {
-            c1NormEntry.position = filePosition;
-            c1NormEntry.size = sizeInBytes;
-            found1 = true;
-        }
-        if (chrIdx == c2 && normtype == norm && unit1 == unit && resolution1 == resolution) {
-            c2NormEntry.position = filePosition;
-            c2NormEntry.size = sizeInBytes;
-            found2 = true;
-        }
-    }
-    if (!found1 || !found2) {
-        cerr << "File did not contain " << norm << " normalization vectors for one or both chromosomes at "
-             << resolution << " " << unit << endl;
+        indexEntry entry;
+        entry.position = filePosition;
+        entry.size = sizeInBytes;
+        normVectorIndex[getNormKey(normtype, chrIdx, unit1, resolution1)] = entry;
     }
     return true;
 }
 
-// reads the raw binned contact matrix at specified resolution, setting the block bin count and block column count 
-map <int, indexEntry> readMatrixZoomData(istream& fin, string myunit, int mybinsize, int &myBlockBinCount, int &myBlockColumnCount, bool &found) {
+// reads the footer from the master pointer location: the master index, then the expected
+// value maps, which are skipped, then the norm vector index
+bool readFooter(istream& fin, int version, unordered_map<string, indexEntry> &masterIndex,
+                unordered_map<string, indexEntry> &normVectorIndex) {
+    if (!readMasterIndex(fin, version, masterIndex)) return false;
 
-    map<int, indexEntry> blockMap;
-    string unit;
-    getline(fin, unit, '\0'); // unit
-    readIntFromFile(fin); // Old "zoom" index -- not used
-    readFloatFromFile(fin); // sumCounts
-    readFloatFromFile(fin); // occupiedCellCount
-    readFloatFromFile(fin); // stdDev
-    readFloatFromFile(fin); // percent95
-    int binSize = readIntFromFile(fin);
-    int blockBinCount = readIntFromFile(fin);
-    int blockColumnCount = readIntFromFile(fin);
+    // skip the expected value maps, seeking over their values by size, to get to the
+    // norm vector index
+    int nExpectedValues = readIntFromFile(fin);
+    for (int i = 0; i < nExpectedValues && fin; i++) {
+        string unit;
+        getline(fin, unit, '\0'); //unit
+        skipExpectedValues(fin, version);
+    }
 
-    found = false;
-    if (myunit == unit && mybinsize == binSize) {
-        myBlockBinCount = blockBinCount;
-        myBlockColumnCount = blockColumnCount;
-        found = true;
+    nExpectedValues = readIntFromFile(fin);
+    for (int i = 0; i < nExpectedValues && fin; i++) {
+        string type, unit;
+        getline(fin, type, '\0'); //typeString
+        getline(fin, unit, '\0'); //unit
+        skipExpectedValues(fin, version);
     }
 
-    int nBlocks = readIntFromFile(fin);
+    return readNormVectorIndex(fin, version, normVectorIndex);
+}
 
-    for (int b = 0; b < nBlocks; b++) {
-        int blockNumber = readIntFromFile(fin);
-        long filePosition = readLongFromFile(fin);
-        int blockSizeInBytes = readIntFromFile(fin);
-        indexEntry entry;
-        entry.size = (long) blockSizeInBytes;
-        entry.position = filePosition;
-        if (found) blockMap[blockNumber] = entry;
-    }
-    return blockMap;
+// looks up a block in the sorted block index; returns false if the block is not stored
+bool matrixZoomData::findBlock(int blockNumber, indexEntry &entry) const {
+    vector<int>::const_iterator it = lower_bound(blockNumbers.begin(), blockNumbers.end(), blockNumber);
+    if (it == blockNumbers.end() || *it != blockNumber) return false;
+    entry = blockEntries[it - blockNumbers.begin()];
+    return true;
 }
 
-// reads the raw binned contact matrix at specified resolution, setting the block bin count and block column count 
-map <int, indexEntry> readMatrixZoomDataHttp(CURL* curl, long &myFilePosition, string myunit, int mybinsize, int &myBlockBinCount, int &myBlockColumnCount, bool &found) {
+// sorts the block index by block number; .hic writers emit it sorted, so this is
+// usually just the check
+void sortBlockIndex(matrixZoomData &zoomData) {
+    if (is_sorted(zoomData.blockNumbers.begin(), zoomData.blockNumbers.end())) return;
+    vector<pair<int, indexEntry> > blocks(zoomData.blockNumbers.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i] = make_pair(zoomData.blockNumbers[i], zoomData.blockEntries[i]);
+    }
+    sort(blocks.begin(), blocks.end(),
+         [](const pair<int, indexEntry> &a, const pair<int, indexEntry> &b) { return a.first < b.first; });
+    for (size_t i = 0; i < blocks.size(); i++) {
+        zoomData.blockNumbers[i] = blocks[i].first;
+        zoomData.blockEntries[i] = blocks[i].second;
+    }
+}
 
-    map<int, indexEntry> blockMap;
-    char *buffer;
-    int header_size = 5 * sizeof(int) + 4 * sizeof(float);
-    char *first;
-    first = getData(curl, myFilePosition, 1);
-    if (first[0] == 'B') {
-        header_size += 3;
-    } else if (first[0] == 'F') {
-        header_size += 5;
-    } else {
-        cerr << "Unit not understood" << endl;
-        return blockMap;
-    }
-    buffer = getData(curl, myFilePosition, header_size);
-    membuf sbuf(buffer, buffer + header_size);
-    istream fin(&sbuf);
-
-    string unit;
-    getline(fin, unit, '\0'); // unit
-    readIntFromFile(fin); // Old "zoom" index -- not used
-    readFloatFromFile(fin); // sumCounts
-    readFloatFromFile(fin); // occupiedCellCount
-    readFloatFromFile(fin); // stdDev
-    readFloatFromFile(fin); // percent95
-    int binSize = readIntFromFile(fin);
-    int blockBinCount = readIntFromFile(fin);
-    int blockColumnCount = readIntFromFile(fin);
-
-    found = false;
-    if (myunit == unit && mybinsize == binSize) {
-        myBlockBinCount = blockBinCount;
-        myBlockColumnCount = blockColumnCount;
-        found = true;
-    }
-
-    int nBlocks = readIntFromFile(fin);
-
-    if (found) {
-        buffer = getData(curl, myFilePosition + header_size, nBlocks * (sizeof(int) + sizeof(long) + sizeof(int)));
-        membuf sbuf2(buffer, buffer + nBlocks * (sizeof(int) + sizeof(long) + sizeof(int)));
-        istream fin2(&sbuf2);
-        for (int b = 0; b < nBlocks; b++) {
-            int blockNumber = readIntFromFile(fin2);
-            long filePosition = readLongFromFile(fin2);
-            int blockSizeInBytes = readIntFromFile(fin2);
-            indexEntry entry;
-            entry.size = (long) blockSizeInBytes;
-            entry.position = filePosition;
-            blockMap[blockNumber] = entry;
-        }
-    } else {
-        myFilePosition = myFilePosition + header_size + (nBlocks * (sizeof(int) + sizeof(long) + sizeof(int)));
+// reads the header of every resolution of the matrix at myFilePosition, skipping over the block indices
+bool readMatrixResolutions(istream &fin, long myFilePosition, vector<zoomLevel> &levels) {
+    fin.seekg(myFilePosition, ios::beg);
+    readIntFromFile(fin); // c1
+    readIntFromFile(fin); // c2
+    int nRes = readIntFromFile(fin);
+    levels.clear();
+    for (int i = 0; i < nRes && fin; i++) {
+        zoomLevel level;
+        getline(fin, level.unit, '\0');
+        readIntFromFile(fin); // Old "zoom" index -- not used
+        level.sumCounts = readFloatFromFile(fin);
+        readFloatFromFile(fin); // occupiedCellCount
+        readFloatFromFile(fin); // stdDev
+        readFloatFromFile(fin); // percent95
+        level.binSize = readIntFromFile(fin);
+        level.blockBinCount = readIntFromFile(fin);
+        level.blockColumnCount = readIntFromFile(fin);
+        level.nBlocks = readIntFromFile(fin);
+        level.indexPosition = fin.tellg();
+        if (!fin || level.nBlocks < 0) break;
+        levels.push_back(level);
+        fin.seekg(level.nBlocks * (sizeof(int) + sizeof(long) + sizeof(int)), ios::cur);
+    }
+    if ((int) levels.size() != nRes) {
+        cerr << "Matrix header is truncated or corrupt" << endl;
+        return false;
     }
-    delete buffer;
-    return blockMap;
+    return true;
 }
 
-// goes to the specified file pointer in http and finds the raw contact matrix at specified resolution, calling readMatrixZoomData.
-// sets blockbincount and blockcolumncount
-map <int, indexEntry> readMatrixHttp(CURL *curl, long myFilePosition, string unit, int resolution, int &myBlockBinCount, int &myBlockColumnCount) {
-    char *buffer;
-    int size = sizeof(int) * 3;
-    buffer = getData(curl, myFilePosition, size);
-    membuf sbuf(buffer, buffer + size);
-    istream bufin(&sbuf);
+// first and last bin, inclusive, of a region in base pairs (or fragments), matching the bins getRecords returns
+void getRegionBins(long start, long end, int binsize, long &firstBin, long &lastBin) {
+    firstBin = (start + binsize - 1) / binsize;
+    lastBin = end / binsize;
+}
 
-    int c1 = readIntFromFile(bufin);
-    int c2 = readIntFromFile(bufin);
-    int nRes = readIntFromFile(bufin);
-    int i = 0;
-    bool found = false;
-    myFilePosition = myFilePosition + size;
-    delete buffer;
-    map<int, indexEntry> blockMap;
-
-    while (i < nRes && !found) {
-        // myFilePosition gets updated within call
-        blockMap = readMatrixZoomDataHttp(curl, myFilePosition, unit, resolution, myBlockBinCount, myBlockColumnCount,
-                                          found);
-        i++;
-    }
-    if (!found) {
-        cerr << "Error finding block data" << endl;
-    }
-    return blockMap;
+// the bins a block may hold: its bounding box, and the ranges of binX + binY and binY - binX
+struct blockBounds {
+    long x1, x2, y1, y2;
+    long s1, s2, d1, d2;
+};
+
+// whether the block may hold a bin of the rectangle x1..x2 by y1..y2: neither shape is convex-separable
+// from the other along x, y, x + y or y - x
+bool blockOverlaps(const blockBounds &b, long x1, long x2, long y1, long y2) {
+    return b.x1 <= x2 && b.x2 >= x1 && b.y1 <= y2 && b.y2 >= y1 &&
+           b.s1 <= x2 + y2 && b.s2 >= x1 + y1 && b.d1 <= y2 - x1 && b.d2 >= y1 - x2;
 }
 
-// goes to the specified file pointer and finds the raw contact matrix at specified resolution, calling readMatrixZoomData.
-// sets blockbincount and blockcolumncount
-map <int, indexEntry> readMatrix(istream& fin, long myFilePosition, string unit, int resolution, int &myBlockBinCount, int &myBlockColumnCount) {
-    map <int, indexEntry> blockMap;
+bool blockInside(const blockBounds &b, long x1, long x2, long y1, long y2) {
+    return b.x1 >= x1 && b.x2 <= x2 && b.y1 >= y1 && b.y2 <= y2;
+}
 
-    fin.seekg(myFilePosition, ios::beg);
-    int c1 = readIntFromFile(fin);
-    int c2 = readIntFromFile(fin);
-    int nRes = readIntFromFile(fin);
-    int i = 0;
-    bool found = false;
-    while (i < nRes && !found) {
-        blockMap = readMatrixZoomData(fin, unit, resolution, myBlockBinCount, myBlockColumnCount, found);
-        i++;
+// adds the block to blockNumbers unless it is outside the region of bins (and, intrachromosomal, its
+// mirror image), and to insideBlocks as well when all of it is in there
+void classifyBlock(int blockNumber, const blockBounds &b, const long *bins, bool intra, set<int> &blockNumbers,
+                   set<int> &insideBlocks) {
+    if (!blockOverlaps(b, bins[0], bins[1], bins[2], bins[3]) &&
+        !(intra && blockOverlaps(b, bins[2], bins[3], bins[0], bins[1]))) {
+        return;
     }
-    if (!found) {
-        cerr << "Error finding block data" << endl;
+    blockNumbers.insert(blockNumber);
+    if (blockInside(b, bins[0], bins[1], bins[2], bins[3]) ||
+        (intra && blockInside(b, bins[2], bins[3], bins[0], bins[1]))) {
+        insideBlocks.insert(blockNumber);
     }
-    return blockMap;
 }
 
-// gets the blocks that need to be read for this slice of the data.  needs blockbincount, blockcolumncount, and whether
-// or not this is intrachromosomal.
-set<int>
-getBlockNumbersForRegionFromBinPosition(long *regionIndices, int blockBinCount, int blockColumnCount, bool intra) {
-    int col1 = regionIndices[0] / blockBinCount;
-    int col2 = (regionIndices[1] + 1) / blockBinCount;
-    int row1 = regionIndices[2] / blockBinCount;
-    int row2 = (regionIndices[3] + 1) / blockBinCount;
+// depth of a contact's block in the v9 intrachromosomal layout, from its distance to the diagonal
+int getV9Depth(long distance, int blockBinCount) {
+    return (int) log2(1 + distance / sqrt(2) / blockBinCount);
+}
+
+// smallest distance to the diagonal at the given v9 depth
+long getV9DepthStart(int depth, int blockBinCount) {
+    if (depth <= 0) return 0;
+    long distance = (long) ceil((pow(2.0, depth) - 1) * sqrt(2) * blockBinCount);
+    while (distance > 0 && getV9Depth(distance - 1, blockBinCount) >= depth) distance--;
+    while (getV9Depth(distance, blockBinCount) < depth) distance++;
+    return distance;
+}
+
+long floorHalf(long value) {
+    return value >= 0 ? value / 2 : -((1 - value) / 2);
+}
 
-    set<int> blocksSet;
-    // first check the upper triangular matrix
-    for (int r = row1; r <= row2; r++) {
-        for (int c = col1; c <= col2; c++) {
-            int blockNumber = r * blockColumnCount + c;
-            blocksSet.insert(blockNumber);
+// blocks of the region of bins x1..x2 by y1..y2 (bins[0..3], as getRegionBins gives them), from the bins
+// each block covers rather than a bounding rectangle: blocks with none of the region's bins are left out,
+// and blocks with only the region's bins also go into insideBlocks, whose contacts need no range check.
+// intrachromosomal regions include their mirror image; v9 intrachromosomal matrices are laid out in
+// bands along the diagonal
+void getBlocksForRegion(const long *bins, int blockBinCount, int blockColumnCount, bool intra, bool v9,
+                        set<int> &blockNumbers, set<int> &insideBlocks) {
+    long x1 = max(0L, bins[0]), x2 = bins[1], y1 = max(0L, bins[2]), y2 = bins[3];
+    if (x1 > x2 || y1 > y2 || blockBinCount <= 0) return;
+    long region[4] = {x1, x2, y1, y2};
+
+    if (!(v9 && intra)) {
+        for (int mirrored = 0; mirrored < (intra ? 2 : 1); mirrored++) {
+            // columns past the last would alias blocks of the next row
+            long cols1 = (mirrored ? y1 : x1) / blockBinCount;
+            long cols2 = min((mirrored ? y2 : x2) / blockBinCount, (long) blockColumnCount - 1);
+            long rows1 = (mirrored ? x1 : y1) / blockBinCount, rows2 = (mirrored ? x2 : y2) / blockBinCount;
+            for (long r = rows1; r <= rows2; r++) {
+                for (long c = cols1; c <= cols2; c++) {
+                    blockBounds b;
+                    b.x1 = c * blockBinCount;
+                    b.x2 = b.x1 + blockBinCount - 1;
+                    b.y1 = r * blockBinCount;
+                    b.y2 = b.y1 + blockBinCount - 1;
+                    b.s1 = b.x1 + b.y1;
+                    b.s2 = b.x2 + b.y2;
+                    b.d1 = b.y1 - b.x2;
+                    b.d2 = b.y2 - b.x1;
+                    classifyBlock((int) (r * blockColumnCount + c), b, region, intra, blockNumbers, insideBlocks);
+                }
+            }
         }
+        return;
     }
-    // check region part that overlaps with lower left triangle but only if intrachromosomal
-    if (intra) {
-        for (int r = col1; r <= col2; r++) {
-            for (int c = row1; c <= row2; c++) {
-                int blockNumber = r * blockColumnCount + c;
-                blocksSet.insert(blockNumber);
-            }
+
+    // a v9 block holds the contacts whose (binX + binY) / 2 falls in its pad and whose distance to the
+    // diagonal falls in its depth; depths are widened by a bin so rounding in log2 cannot drop a contact
+    long nearest = (y1 - x2 <= 0 && y2 - x1 >= 0) ? 0 : min(labs(y1 - x2), labs(y2 - x1));
+    long furthest = max(labs(y1 - x2), labs(y2 - x1));
+    int depth1 = max(0, getV9Depth(nearest, blockBinCount) - 1);
+    int depth2 = getV9Depth(furthest, blockBinCount) + 1;
+    long pad1 = (x1 + y1) / 2 / blockBinCount;
+    long pad2 = min((x2 + y2) / 2 / blockBinCount, (long) blockColumnCount - 1);
+    for (int depth = depth1; depth <= depth2; depth++) {
+        blockBounds b;
+        b.d1 = max(0L, getV9DepthStart(depth, blockBinCount) - 1);
+        b.d2 = getV9DepthStart(depth + 1, blockBinCount);
+        for (long pad = pad1; pad <= pad2; pad++) {
+            b.s1 = 2 * pad * blockBinCount;
+            b.s2 = 2 * (pad + 1) * blockBinCount - 1;
+            b.x1 = floorHalf(b.s1 - b.d2);
+            b.x2 = -floorHalf(b.d1 - b.s2);
+            b.y1 = floorHalf(b.s1 + b.d1);
+            b.y2 = -floorHalf(-(b.s2 + b.d2));
+            classifyBlock((int) (depth * blockColumnCount + pad), b, region, intra, blockNumbers, insideBlocks);
         }
     }
-    return blocksSet;
 }
 
-set<int>
-getBlockNumbersForRegionFromBinPositionV9Intra(long *regionIndices, int blockBinCount, int blockColumnCount) {
-    // regionIndices is binX1 binX2 binY1 binY2
-    set<int> blocksSet;
-    int translatedLowerPAD = (regionIndices[0] + regionIndices[2]) / 2 / blockBinCount;
-    int translatedHigherPAD = (regionIndices[1] + regionIndices[3]) / 2 / blockBinCount + 1;
-    int translatedNearerDepth = log2(1 + abs(regionIndices[0] - regionIndices[3]) / sqrt(2) / blockBinCount);
-    int translatedFurtherDepth = log2(1 + abs(regionIndices[1] - regionIndices[2]) / sqrt(2) / blockBinCount);
-
-    // because code above assume above diagonal; but we could be below diagonal
-    int nearerDepth = min(translatedNearerDepth, translatedFurtherDepth);
-    if ((regionIndices[0] > regionIndices[3] && regionIndices[1] < regionIndices[2]) ||
-        (regionIndices[1] > regionIndices[2] && regionIndices[0] < regionIndices[3])) {
-        nearerDepth = 0;
+// reusable buffers for compressed bytes and decoded records. a buffer goes back to its pool when
+// the last shared_ptr to it is dropped, on whichever thread that happens; the pool keeps at most
+// maxBuffers of them and lets larger than maxBytes ones be freed
+template<class T>
+class bufferPool {
+public:
+    bufferPool(size_t maxBuffers, size_t maxBytes) : maxBuffers(maxBuffers), maxBytes(maxBytes) {}
+
+    shared_ptr<vector<T> > acquire() {
+        vector<T> *buffer = NULL;
+        {
+            lock_guard<std::mutex> lock(mutex);
+            if (!buffers.empty()) {
+                buffer = buffers.back();
+                buffers.pop_back();
+            }
+        }
+        if (!buffer) buffer = new vector<T>();
+        return shared_ptr<vector<T> >(buffer, [this](vector<T> *b) { release(b); });
     }
-    int furtherDepth = max(translatedNearerDepth, translatedFurtherDepth) + 1; // +1; integer divide rounds down
 
-    for (int depth = nearerDepth; depth <= furtherDepth; depth++) {
-        for (int pad = translatedLowerPAD; pad <= translatedHigherPAD; pad++) {
-            int blockNumber = depth * blockColumnCount + pad;
-            blocksSet.insert(blockNumber);
+private:
+    void release(vector<T> *buffer) {
+        buffer->clear();
+        if (buffer->capacity() * sizeof(T) <= maxBytes) {
+            lock_guard<std::mutex> lock(mutex);
+            if (buffers.size() < maxBuffers) {
+                buffers.push_back(buffer);
+                return;
+            }
         }
+        delete buffer;
     }
 
-    return blocksSet;
+    size_t maxBuffers;
+    size_t maxBytes;
+    std::mutex mutex;
+    vector<vector<T> *> buffers;
+};
+
+// the pools live for the whole program, since cached blocks may be released during static destruction
+bufferPool<char> &getBytePool() {
+    static bufferPool<char> *pool = new bufferPool<char>(64, 4 * 1024 * 1024);
+    return *pool;
 }
 
-// this is the meat of reading the data.  takes in the block number and returns the set of contact records corresponding to
-// that block.  the block data is compressed and must be decompressed using the zlib library functions
-vector<contactRecord> readBlock(istream &fin, CURL *curl, bool isHttp, indexEntry idx) {
-    if (idx.size == 0) {
-        vector<contactRecord> v;
-        return v;
-    }
-    char *compressedBytes = new char[idx.size];
-    char *uncompressedBytes = new char[idx.size * 10]; //biggest seen so far is 3
+bufferPool<contactRecord> &getRecordPool() {
+    static bufferPool<contactRecord> *pool = new bufferPool<contactRecord>(64, 4 * 1024 * 1024);
+    return *pool;
+}
 
-    if (isHttp) {
-        compressedBytes = getData(curl, idx.position, idx.size);
-    } else {
-        fin.seekg(idx.position, ios::beg);
-        fin.read(compressedBytes, idx.size);
+// scratch space for inflating blocks. one per thread, so workers never share it and it is only
+// reallocated when a block is bigger than any this thread has seen
+vector<char> &getInflateBuffer() {
+    static thread_local vector<char> buffer;
+    return buffer;
+}
+
+// decompresses a block into buffer, growing it as needed; the buffer is never shrunk, so callers
+// can keep one around and reuse it. returns the uncompressed size. the inflater is chosen at
+// build time: define STRAW_USE_LIBDEFLATE to use libdeflate, otherwise zlib (or zlib-ng in its
+// zlib-compatible mode, which needs no changes here)
+#ifdef STRAW_USE_LIBDEFLATE
+int inflateBlock(const char *compressedBytes, long compressedSize, vector<char> &buffer) {
+    // decompressors are not thread safe, so each thread keeps its own
+    struct decompressor {
+        libdeflate_decompressor *d;
+        decompressor() : d(libdeflate_alloc_decompressor()) {}
+        ~decompressor() { libdeflate_free_decompressor(d); }
+    };
+    static thread_local decompressor inflater;
+
+    if (buffer.size() < (size_t) compressedSize * 4) buffer.resize(compressedSize * 4);
+    while (true) {
+        size_t uncompressedSize = 0;
+        libdeflate_result result = libdeflate_zlib_decompress(inflater.d, compressedBytes, compressedSize,
+                                                              buffer.data(), buffer.size(), &uncompressedSize);
+        if (result == LIBDEFLATE_SUCCESS) return (int) uncompressedSize;
+        if (result != LIBDEFLATE_INSUFFICIENT_SPACE) {
+            cerr << "Block could not be decompressed" << endl;
+            return 0;
+        }
+        buffer.resize(buffer.size() * 2);
     }
-    // Decompress the block
+}
+
+// decompresses only the first size bytes of a block into out, returning how many were written.
+// libdeflate has no streaming interface, so the whole block is inflated
+int inflatePrefix(const char *compressedBytes, long compressedSize, char *out, int size) {
+    vector<char> &buffer = getInflateBuffer();
+    int uncompressedSize = min(size, inflateBlock(compressedBytes, compressedSize, buffer));
+    memcpy(out, buffer.data(), uncompressedSize);
+    return uncompressedSize;
+}
+#else
+int inflateBlock(const char *compressedBytes, long compressedSize, vector<char> &buffer) {
+    if (buffer.size() < (size_t) compressedSize * 4) buffer.resize(compressedSize * 4);
+
     // zlib struct
     z_stream infstream;
     infstream.zalloc = Z_NULL;
     infstream.zfree = Z_NULL;
     infstream.opaque = Z_NULL;
-    infstream.avail_in = (uLong) (idx.size); // size of input
+    infstream.avail_in = (uInt) (compressedSize); // size of input
     infstream.next_in = (Bytef *) compressedBytes; // input char array
-    infstream.avail_out = (uLong) idx.size * 10; // size of output
-    infstream.next_out = (Bytef *) uncompressedBytes; // output char array
-    // the actual decompression work.
+    infstream.avail_out = (uInt) buffer.size(); // size of output
+    infstream.next_out = (Bytef *) buffer.data(); // output char array
     inflateInit(&infstream);
-    inflate(&infstream, Z_NO_FLUSH);
-    inflateEnd(&infstream);
-    int uncompressedSize = infstream.total_out;
-
-    // create stream from buffer for ease of use
-    membuf sbuf(uncompressedBytes, uncompressedBytes + uncompressedSize);
-    istream bufferin(&sbuf);
-    int nRecords = readIntFromFile(bufferin);
-    vector<contactRecord> v(nRecords);
-    // different versions have different specific formats
-    if (version < 7) {
-        for (int i = 0; i < nRecords; i++) {
-            contactRecord record;
-            record.binX = readIntFromFile(bufferin);
-            record.binY = readIntFromFile(bufferin);
-            record.counts = readFloatFromFile(bufferin);
-            v[i] = record;
-        }
-    } else {
-        int binXOffset = readIntFromFile(bufferin);
-        int binYOffset = readIntFromFile(bufferin);
-        bool useShort = readCharFromFile(bufferin) == 0; // yes this is opposite of usual
-
-        bool useShortBinX = true;
-        bool useShortBinY = true;
-        if (version > 8) {
-            useShortBinX = readCharFromFile(bufferin) == 0;
-            useShortBinY = readCharFromFile(bufferin) == 0;
-        }
-
-        char type = readCharFromFile(bufferin);
-        int index = 0;
-        if (type == 1) {
-            if (useShortBinX && useShortBinY) {
-                short rowCount = readShortFromFile(bufferin);
-                for (short i = 0; i < rowCount; i++) {
-                    int binY = binYOffset + readShortFromFile(bufferin);
-                    short colCount = readShortFromFile(bufferin);
-                    for (short j = 0; j < colCount; j++) {
-                        int binX = binXOffset + readShortFromFile(bufferin);
-                        float counts;
-                        if (useShort) {
-                            counts = readShortFromFile(bufferin);
-                        } else {
-                            bufferin.read((char *) &counts, sizeof(float));
-                        }
-                        contactRecord record;
-                        record.binX = binX;
-                        record.binY = binY;
-                        record.counts = counts;
-                        v[index] = record;
-                        index++;
-                    }
-                }
-            } else if (useShortBinX && !useShortBinY) {
-                int rowCount = readIntFromFile(bufferin);
-                for (int i = 0; i < rowCount; i++) {
-                    int binY = binYOffset + readIntFromFile(bufferin);
-                    short colCount = readShortFromFile(bufferin);
-                    for (short j = 0; j < colCount; j++) {
-                        int binX = binXOffset + readShortFromFile(bufferin);
-                        float counts;
-                        if (useShort) {
-                            counts = readShortFromFile(bufferin);
-                        } else {
-                            bufferin.read((char *) &counts, sizeof(float));
-                        }
-                        contactRecord record;
-                        record.binX = binX;
-                        record.binY = binY;
-                        record.counts = counts;
-                        v[index] = record;
-                        index++;
-                    }
-                }
-            } else if (!useShortBinX && useShortBinY) {
-                short rowCount = readShortFromFile(bufferin);
-                for (short i = 0; i < rowCount; i++) {
-                    int binY = binYOffset + readShortFromFile(bufferin);
-                    int colCount = readIntFromFile(bufferin);
-                    for (int j = 0; j < colCount; j++) {
-                        int binX = binXOffset + readIntFromFile(bufferin);
-                        float counts;
-                        if (useShort) {
-                            counts = readShortFromFile(bufferin);
-                        } else {
-                            bufferin.read((char *) &counts, sizeof(float));
-                        }
-                        contactRecord record;
-                        record.binX = binX;
-                        record.binY = binY;
-                        record.counts = counts;
-                        v[index] = record;
-                        index++;
-                    }
-                }
-            } else {
-                int rowCount = readIntFromFile(bufferin);
-                for (int i = 0; i < rowCount; i++) {
-                    int binY = binYOffset + readIntFromFile(bufferin);
-                    int colCount = readIntFromFile(bufferin);
-                    for (int j = 0; j < colCount; j++) {
-                        int binX = binXOffset + readIntFromFile(bufferin);
-                        float counts;
-                        if (useShort) {
-                            counts = readShortFromFile(bufferin);
-                        } else {
-                            bufferin.read((char *) &counts, sizeof(float));
-                        }
-                        contactRecord record;
-                        record.binX = binX;
-                        record.binY = binY;
-                        record.counts = counts;
-                        v[index] = record;
-                        index++;
-                    }
-                }
-            }
-        } else if (type == 2) {
-            int nPts = readIntFromFile(bufferin);
-            short w = readShortFromFile(bufferin);
-
-            for (int i = 0; i < nPts; i++) {
-                //int idx = (p.y - binOffset2) * w + (p.x - binOffset1);
-                int row = i / w;
-                int col = i - row * w;
-                int bin1 = binXOffset + col;
-                int bin2 = binYOffset + row;
-
-                float counts;
-                if (useShort) {
-                    short c = readShortFromFile(bufferin);
-                    if (c != -32768) {
-                        contactRecord record;
-                        record.binX = bin1;
-                        record.binY = bin2;
-                        record.counts = c;
-                        v[index] = record;
-                        index++;
-                    }
-                } else {
-                    bufferin.read((char *) &counts, sizeof(float));
-                    if (!isnan(counts)) {
-                        contactRecord record;
-                        record.binX = bin1;
-                        record.binY = bin2;
-                        record.counts = counts;
-                        v[index] = record;
-                        index++;
-                    }
-                }
-            }
-        }
+    // the actual decompression work. blocks usually inflate to about 3 times their size, but
+    // nothing guarantees it, so double the buffer until the whole stream fits
+    int status;
+    while ((status = inflate(&infstream, Z_NO_FLUSH)) == Z_OK || status == Z_BUF_ERROR) {
+        if (infstream.avail_out != 0) break; // input exhausted without reaching the end
+        long used = infstream.total_out;
+        buffer.resize(buffer.size() * 2);
+        infstream.next_out = (Bytef *) buffer.data() + used;
+        infstream.avail_out = (uInt) (buffer.size() - used);
     }
-    delete[] compressedBytes;
-    delete[] uncompressedBytes; // don't forget to delete your heap arrays in C++!
-    return v;
-}
-
-int readSize(istream& fin, CURL* curl, bool isHttp, indexEntry idx) {
-    if (idx.size == 0) {
-        return 0;
+    if (status != Z_STREAM_END) {
+        cerr << "Block could not be decompressed" << endl;
     }
-    char *compressedBytes = new char[idx.size];
-    char *uncompressedBytes = new char[idx.size * 10];
+    int uncompressedSize = (int) infstream.total_out;
+    inflateEnd(&infstream);
+    return uncompressedSize;
+}
 
-    if (isHttp) {
-        compressedBytes = getData(curl, idx.position, idx.size);
-    } else {
-        fin.seekg(idx.position, ios::beg);
-        fin.read(compressedBytes, idx.size);
-    }
-    // Decompress the block
-    // zlib struct
+// decompresses only the first size bytes of a block into out, returning how many were written.
+// inflate stops as soon as the output is full, so the rest of the block is never decoded
+int inflatePrefix(const char *compressedBytes, long compressedSize, char *out, int size) {
     z_stream infstream;
     infstream.zalloc = Z_NULL;
     infstream.zfree = Z_NULL;
     infstream.opaque = Z_NULL;
-    infstream.avail_in = (uLong) (idx.size); // size of input
-    infstream.next_in = (Bytef *) compressedBytes; // input char array
-    infstream.avail_out = (uLong) idx.size * 10; // size of output
-    infstream.next_out = (Bytef *) uncompressedBytes; // output char array
-    // the actual decompression work.
+    infstream.avail_in = (uInt) (compressedSize);
+    infstream.next_in = (Bytef *) compressedBytes;
+    infstream.avail_out = (uInt) size;
+    infstream.next_out = (Bytef *) out;
     inflateInit(&infstream);
-    inflate(&infstream, Z_NO_FLUSH);
+    int status = inflate(&infstream, Z_SYNC_FLUSH);
+    if (status != Z_OK && status != Z_STREAM_END) {
+        cerr << "Block could not be decompressed" << endl;
+    }
+    int uncompressedSize = (int) infstream.total_out;
     inflateEnd(&infstream);
-    int uncompressedSize = infstream.total_out;
+    return uncompressedSize;
+}
+#endif
 
-    // create stream from buffer for ease of use
-    membuf sbuf(uncompressedBytes, uncompressedBytes + uncompressedSize);
-    istream bufferin(&sbuf);
-    int nRecords = readIntFromFile(bufferin);
-    delete[] compressedBytes;
-    delete[] uncompressedBytes;
-    return nRecords;
+// loads a little-endian value from a possibly unaligned address
+template<class T>
+inline T loadLittleEndian(const char *p) {
+    T value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    char bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i++) bytes[i] = p[sizeof(T) - 1 - i];
+    memcpy(&value, bytes, sizeof(T));
+#else
+    memcpy(&value, p, sizeof(T));
+#endif
+    return value;
 }
 
+// reads little-endian values from a byte buffer. callers check available() once per row
+// or batch of records, then read without further checks
+class byteCursor {
+public:
+    byteCursor(const char *begin, const char *end) : pos(begin), end(end) {}
 
-// reads the normalization vector from the file at the specified location
-vector<double> readNormalizationVector(istream& bufferin) {
-    long nValues;
-    if (version > 8) {
-        bufferin.read((char *) &nValues, sizeof(long));
-    } else {
-        nValues = (long) readIntFromFile(bufferin);
-    }
+    size_t available() const { return end - pos; }
 
-    vector<double> values((int) nValues);
+    const char *position() const { return pos; }
 
-    if (version > 8) {
-        for (long i = 0; i < nValues; i++) {
-            values[i] = (double) readFloatFromFile(bufferin);
-        }
-    } else {
-        for (int i = 0; i < nValues; i++) {
-            values[i] = readDoubleFromFile(bufferin);
-        }
+    void skip(size_t n) { pos += n; }
+
+    template<class T>
+    T read() {
+        T value = loadLittleEndian<T>(pos);
+        pos += sizeof(T);
+        return value;
     }
 
-    //  if (allNaN) return null;
-    return values;
+private:
+    const char *pos;
+    const char *end;
+};
+
+// type 2 blocks mark empty cells with these sentinels
+inline bool isEmptyCell(short c) {
+    return c == -32768;
 }
 
-vector<contactRecord> straw(string norm, string fname, string chr1loc, string chr2loc, string unit, int binsize) {
-    if (!(unit == "BP" || unit == "FRAG")) {
-        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
-        cerr << "Usage: straw <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>"
-             << endl;
-        vector <contactRecord> v;
-        return v;
+inline bool isEmptyCell(float c) {
+    return isnan(c);
+}
+
+// type 1 rows and type 2 grids are decoded in chunks of this many entries into the scratch
+// arrays below, so the widening kernels never need more than a small stack buffer
+const int decodeChunk = 256;
+
+// widens a chunk of interleaved type 1 (binX offset, counts) pairs into bin numbers and float counts
+template<class X, class C>
+inline void widenColumnsScalar(const char *src, int n, int binXOffset, int *binX, float *counts) {
+    for (int i = 0; i < n; i++, src += sizeof(X) + sizeof(C)) {
+        binX[i] = binXOffset + loadLittleEndian<X>(src);
+        counts[i] = loadLittleEndian<C>(src + sizeof(X));
     }
+}
 
-    // HTTP code
-    string prefix = "http";
-    bool isHttp = false;
-    ifstream fin;
+// keeps the non-empty cells of a chunk of a type 2 row; returns how many were kept
+template<class C>
+inline int compactCellsScalar(const char *src, int n, int firstBinX, int *binX, float *counts) {
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        C c = loadLittleEndian<C>(src + i * sizeof(C));
+        if (isEmptyCell(c)) continue;
+        binX[kept] = firstBinX + i;
+        counts[kept++] = c;
+    }
+    return kept;
+}
 
-    // read header into buffer; 100K should be sufficient
-    CURL *curl;
+#ifdef STRAW_X86_SIMD
+// x86 kernels. SSE2 is always there on x86-64; AVX2 versions are compiled for that target only
+// and picked at run time
+inline bool hasAvx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
 
-    long master;
-    map <string, chromosome> chromosomeMap;
+// short offsets with short counts: each pair is one 32-bit lane, offset in the low half
+inline void widenShortShortSse2(const char *src, int n, int binXOffset, int *binX, float *counts) {
+    const __m128i offset = _mm_set1_epi32(binXOffset);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + 4 * i));
+        __m128i x = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+        __m128i c = _mm_srai_epi32(v, 16);
+        _mm_storeu_si128((__m128i *) (binX + i), _mm_add_epi32(x, offset));
+        _mm_storeu_ps(counts + i, _mm_cvtepi32_ps(c));
+    }
+    widenColumnsScalar<short, short>(src + 4 * i, n - i, binXOffset, binX + i, counts + i);
+}
 
-    if (std::strncmp(fname.c_str(), prefix.c_str(), prefix.size()) == 0) {
-        isHttp = true;
-        char *buffer;
-        curl = initCURL(fname.c_str());
-        if (curl) {
-            buffer = getData(curl, 0, 100000);
-        } else {
-            cerr << "URL " << fname << " cannot be opened for reading" << endl;
-            vector <contactRecord> v;
-            return v;
-        }
-        membuf sbuf(buffer, buffer + 100000);
-        istream bufin(&sbuf);
-        chromosomeMap = readHeader(bufin, master);
-        delete buffer;
-    } else {
-        fin.open(fname, fstream::in);
-        if (!fin) {
-            cerr << "File " << fname << " cannot be opened for reading" << endl;
-            vector <contactRecord> v;
-            return v;
-        }
-        chromosomeMap = readHeader(fin, master);
+__attribute__((target("avx2")))
+void widenShortShortAvx2(const char *src, int n, int binXOffset, int *binX, float *counts) {
+    const __m256i offset = _mm256_set1_epi32(binXOffset);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + 4 * i));
+        __m256i x = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+        __m256i c = _mm256_srai_epi32(v, 16);
+        _mm256_storeu_si256((__m256i *) (binX + i), _mm256_add_epi32(x, offset));
+        _mm256_storeu_ps(counts + i, _mm256_cvtepi32_ps(c));
     }
+    widenColumnsScalar<short, short>(src + 4 * i, n - i, binXOffset, binX + i, counts + i);
+}
 
-    // parse chromosome positions
-    stringstream ss(chr1loc);
-    string chr1, chr2, x, y;
-    long c1pos1 = -100, c1pos2 = -100, c2pos1 = -100, c2pos2 = -100;
-    getline(ss, chr1, ':');
-    if (chromosomeMap.count(chr1) == 0) {
-        cerr << chr1 << " not found in the file." << endl;
-        vector <contactRecord> v;
-        return v;
+// int offsets with float counts: pairs of 32-bit lanes, split into even and odd lanes
+inline void widenIntFloatSse2(const char *src, int n, int binXOffset, int *binX, float *counts) {
+    const __m128i offset = _mm_set1_epi32(binXOffset);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 a = _mm_loadu_ps((const float *) (src + 8 * i));
+        __m128 b = _mm_loadu_ps((const float *) (src + 8 * i + 16));
+        __m128i x = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_si128((__m128i *) (binX + i), _mm_add_epi32(x, offset));
+        _mm_storeu_ps(counts + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
     }
+    widenColumnsScalar<int, float>(src + 8 * i, n - i, binXOffset, binX + i, counts + i);
+}
 
-    if (getline(ss, x, ':') && getline(ss, y, ':')) {
-        c1pos1 = stol(x);
-        c1pos2 = stol(y);
-    } else {
-        c1pos1 = 0;
-        c1pos2 = chromosomeMap[chr1].length;
+__attribute__((target("avx2")))
+void widenIntFloatAvx2(const char *src, int n, int binXOffset, int *binX, float *counts) {
+    const __m256i offset = _mm256_set1_epi32(binXOffset);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 a = _mm256_loadu_ps((const float *) (src + 8 * i));
+        __m256 b = _mm256_loadu_ps((const float *) (src + 8 * i + 32));
+        // the shuffles work within 128-bit halves, so put the 64-bit quarters back in order
+        __m256i x = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m256i c = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        x = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 1, 2, 0));
+        c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *) (binX + i), _mm256_add_epi32(x, offset));
+        _mm256_storeu_ps(counts + i, _mm256_castsi256_ps(c));
     }
-    stringstream ss1(chr2loc);
-    getline(ss1, chr2, ':');
-    if (chromosomeMap.count(chr2) == 0) {
-        cerr << chr2 << " not found in the file." << endl;
-        vector <contactRecord> v;
-        return v;
+    widenColumnsScalar<int, float>(src + 8 * i, n - i, binXOffset, binX + i, counts + i);
+}
+
+// writes the lanes of a widened group whose bit is clear in the empty mask
+inline int keepCells(unsigned empty, int lanes, int firstBinX, const float *values, int *binX, float *counts) {
+    int kept = 0;
+    for (unsigned full = ~empty & ((1u << lanes) - 1); full; full &= full - 1) {
+        int lane = __builtin_ctz(full);
+        binX[kept] = firstBinX + lane;
+        counts[kept++] = values[lane];
     }
+    return kept;
+}
 
-    if (getline(ss1, x, ':') && getline(ss1, y, ':')) {
-        c2pos1 = stol(x);
-        c2pos2 = stol(y);
-    } else {
-        c2pos1 = 0;
-        c2pos2 = chromosomeMap[chr2].length;
+inline int compactShortSse2(const char *src, int n, int firstBinX, int *binX, float *counts) {
+    const __m128i sentinel = _mm_set1_epi16(-32768);
+    int kept = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+        // one bit per cell from the byte mask of the 16-bit compare
+        unsigned bytes = _mm_movemask_epi8(_mm_cmpeq_epi16(v, sentinel));
+        if (bytes == 0xFFFF) continue;
+        unsigned empty = 0;
+        for (int lane = 0; lane < 8; lane++) empty |= ((bytes >> (2 * lane)) & 1u) << lane;
+        float values[8];
+        _mm_storeu_ps(values, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)));
+        _mm_storeu_ps(values + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)));
+        kept += keepCells(empty, 8, firstBinX + i, values, binX + kept, counts + kept);
     }
+    return kept + compactCellsScalar<short>(src + 2 * i, n - i, firstBinX + i, binX + kept, counts + kept);
+}
 
-    // from header have size of chromosomes, set region to read
-    int c1 = min(chromosomeMap[chr1].index, chromosomeMap[chr2].index);
-    int c2 = max(chromosomeMap[chr1].index, chromosomeMap[chr2].index);
-    long origRegionIndices[4]; // as given by user
+__attribute__((target("avx2")))
+int compactShortAvx2(const char *src, int n, int firstBinX, int *binX, float *counts) {
+    const __m128i sentinel = _mm_set1_epi16(-32768);
+    int kept = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+        __m128i isEmpty = _mm_cmpeq_epi16(v, sentinel);
+        if (_mm_movemask_epi8(isEmpty) == 0xFFFF) continue;
+        unsigned empty = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cvtepi16_epi32(isEmpty)));
+        float values[8];
+        _mm256_storeu_ps(values, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)));
+        kept += keepCells(empty, 8, firstBinX + i, values, binX + kept, counts + kept);
+    }
+    return kept + compactCellsScalar<short>(src + 2 * i, n - i, firstBinX + i, binX + kept, counts + kept);
+}
+
+inline int compactFloatSse2(const char *src, int n, int firstBinX, int *binX, float *counts) {
+    int kept = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps((const float *) (src + 4 * i));
+        unsigned empty = _mm_movemask_ps(_mm_cmpunord_ps(v, v));
+        if (empty == 0xF) continue;
+        float values[4];
+        _mm_storeu_ps(values, v);
+        kept += keepCells(empty, 4, firstBinX + i, values, binX + kept, counts + kept);
+    }
+    return kept + compactCellsScalar<float>(src + 4 * i, n - i, firstBinX + i, binX + kept, counts + kept);
+}
+
+__attribute__((target("avx2")))
+int compactFloatAvx2(const char *src, int n, int firstBinX, int *binX, float *counts) {
+    int kept = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps((const float *) (src + 4 * i));
+        unsigned empty = _mm256_movemask_ps(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+        if (empty == 0xFF) continue;
+        float values[8];
+        _mm256_storeu_ps(values, v);
+        kept += keepCells(empty, 8, firstBinX + i, values, binX + kept, counts + kept);
+    }
+    return kept + compactCellsScalar<float>(src + 4 * i, n - i, firstBinX + i, binX + kept, counts + kept);
+}
+#endif
+
+// per-layout entry points. layouts without a vector kernel (6-byte pairs) use the scalar loop
+template<class X, class C>
+inline void widenColumns(const char *src, int n, int binXOffset, int *binX, float *counts) {
+    widenColumnsScalar<X, C>(src, n, binXOffset, binX, counts);
+}
+
+template<class C>
+inline int compactCells(const char *src, int n, int firstBinX, int *binX, float *counts) {
+    return compactCellsScalar<C>(src, n, firstBinX, binX, counts);
+}
+
+#ifdef STRAW_X86_SIMD
+template<>
+inline void widenColumns<short, short>(const char *src, int n, int binXOffset, int *binX, float *counts) {
+    if (hasAvx2()) widenShortShortAvx2(src, n, binXOffset, binX, counts);
+    else widenShortShortSse2(src, n, binXOffset, binX, counts);
+}
+
+template<>
+inline void widenColumns<int, float>(const char *src, int n, int binXOffset, int *binX, float *counts) {
+    if (hasAvx2()) widenIntFloatAvx2(src, n, binXOffset, binX, counts);
+    else widenIntFloatSse2(src, n, binXOffset, binX, counts);
+}
+
+template<>
+inline int compactCells<short>(const char *src, int n, int firstBinX, int *binX, float *counts) {
+    return hasAvx2() ? compactShortAvx2(src, n, firstBinX, binX, counts)
+                     : compactShortSse2(src, n, firstBinX, binX, counts);
+}
+
+template<>
+inline int compactCells<float>(const char *src, int n, int firstBinX, int *binX, float *counts) {
+    return hasAvx2() ? compactFloatAvx2(src, n, firstBinX, binX, counts)
+                     : compactFloatSse2(src, n, firstBinX, binX, counts);
+}
+#endif
+
+// decodes the records of a version 6 block: binX, binY and counts for every record
+template<class Sink>
+bool decodeRecordsV6(byteCursor &in, int nRecords, Sink &sink) {
+    if (nRecords < 0 || in.available() < (size_t) nRecords * (2 * sizeof(int) + sizeof(float)) ||
+        !sink.reserve(nRecords)) {
+        return false;
+    }
+    for (int i = 0; i < nRecords; i++) {
+        int binX = in.read<int>();
+        int binY = in.read<int>();
+        sink.set(binX, binY, in.read<float>());
+    }
+    return true;
+}
+
+// decodes a sparse (type 1) block: rows of binY, each with its binX and counts. X, Y and C are the stored types of
+// the binX offsets, the binY offsets and row/column counts, and the counts; each combination is its own instance
+template<class X, class Y, class C, class Sink>
+bool decodeType1(byteCursor &in, int binXOffset, int binYOffset, Sink &sink) {
+    if (in.available() < sizeof(Y)) return false;
+    int rowCount = in.read<Y>();
+    for (int i = 0; i < rowCount; i++) {
+        if (in.available() < sizeof(Y) + sizeof(X)) return false;
+        int binY = binYOffset + in.read<Y>();
+        int colCount = in.read<X>();
+        if (colCount < 0 || in.available() < (size_t) colCount * (sizeof(X) + sizeof(C)) ||
+            !sink.reserve(colCount)) {
+            return false;
+        }
+        int binX[decodeChunk];
+        float counts[decodeChunk];
+        for (int j = 0; j < colCount; j += decodeChunk) {
+            int n = min(decodeChunk, colCount - j);
+            widenColumns<X, C>(in.position(), n, binXOffset, binX, counts);
+            in.skip(n * (sizeof(X) + sizeof(C)));
+            sink.setColumns(binY, binX, counts, n);
+        }
+    }
+    return true;
+}
+
+// decodes a dense (type 2) block: a w-wide grid of counts, row by row
+template<class C, class Sink>
+bool decodeType2(byteCursor &in, int binXOffset, int binYOffset, Sink &sink) {
+    if (in.available() < sizeof(int) + sizeof(short)) return false;
+    int nPts = in.read<int>();
+    short w = in.read<short>();
+    if (nPts < 0 || w <= 0 || in.available() < (size_t) nPts * sizeof(C)) return false;
+    for (int row = 0; (long) row * w < nPts; row++) {
+        int n = min((int) w, nPts - row * w);
+        sink.template setRow<C>(binYOffset + row, binXOffset, in.position(), n);
+        in.skip(n * sizeof(C));
+    }
+    return true;
+}
+
+// decodes an uncompressed block, passing its contacts to sink. different versions have different specific
+// formats; returns false if the block is truncated or does not fit the sink
+template<class Sink>
+bool decodeRecords(const char *uncompressedBytes, int uncompressedSize, int version, Sink &sink) {
+    byteCursor in(uncompressedBytes, uncompressedBytes + uncompressedSize);
+    if (in.available() < sizeof(int)) return false;
+    int nRecords = in.read<int>();
+    if (version < 7) {
+        return decodeRecordsV6(in, nRecords, sink);
+    }
+
+    if (in.available() < 2 * sizeof(int) + (version > 8 ? 4 : 2)) return false;
+    int binXOffset = in.read<int>();
+    int binYOffset = in.read<int>();
+    bool useShort = in.read<char>() == 0; // yes this is opposite of usual
+    bool useShortBinX = true;
+    bool useShortBinY = true;
+    if (version > 8) {
+        useShortBinX = in.read<char>() == 0;
+        useShortBinY = in.read<char>() == 0;
+    }
+
+    char type = in.read<char>();
+    if (type == 1) {
+        if (useShortBinX && useShortBinY) {
+            return useShort ? decodeType1<short, short, short>(in, binXOffset, binYOffset, sink)
+                            : decodeType1<short, short, float>(in, binXOffset, binYOffset, sink);
+        } else if (useShortBinX && !useShortBinY) {
+            return useShort ? decodeType1<short, int, short>(in, binXOffset, binYOffset, sink)
+                            : decodeType1<short, int, float>(in, binXOffset, binYOffset, sink);
+        } else if (!useShortBinX && useShortBinY) {
+            return useShort ? decodeType1<int, short, short>(in, binXOffset, binYOffset, sink)
+                            : decodeType1<int, short, float>(in, binXOffset, binYOffset, sink);
+        } else {
+            return useShort ? decodeType1<int, int, short>(in, binXOffset, binYOffset, sink)
+                            : decodeType1<int, int, float>(in, binXOffset, binYOffset, sink);
+        }
+    } else if (type == 2) {
+        return useShort ? decodeType2<short>(in, binXOffset, binYOffset, sink)
+                        : decodeType2<float>(in, binXOffset, binYOffset, sink);
+    }
+    return true;
+}
+
+// collects decoded contacts into a vector sized for the block's record count
+struct recordSink {
+    vector<contactRecord> &records;
+    long count;
+
+    recordSink(vector<contactRecord> &records) : records(records), count(0) {}
+
+    bool reserve(long n) const {
+        return count + n <= (long) records.size();
+    }
+
+    void set(int binX, int binY, float counts) {
+        contactRecord &record = records[count++];
+        record.binX = binX;
+        record.binY = binY;
+        record.counts = counts;
+    }
+
+    void setColumns(int binY, const int *binX, const float *counts, int n) {
+        for (int i = 0; i < n; i++) {
+            set(binX[i], binY, counts[i]);
+        }
+    }
+
+    // keeps the non-empty cells of a type 2 row, as many as the block said it had
+    template<class V>
+    void setRow(int binY, int firstBinX, const char *values, int n) {
+        int binX[decodeChunk];
+        float counts[decodeChunk];
+        for (int i = 0; i < n; i += decodeChunk) {
+            int kept = compactCells<V>(values + i * sizeof(V), min(decodeChunk, n - i), firstBinX + i, binX, counts);
+            setColumns(binY, binX, counts, (int) min((long) kept, (long) records.size() - count));
+        }
+    }
+};
+
+// this is the meat of reading the data.  takes in the compressed bytes of a block and fills v with the set of
+// contact records corresponding to that block, reusing its storage.  does no I/O, so blocks can be decoded
+// on worker threads
+void decodeBlock(const char *compressedBytes, long compressedSize, int version, vector<contactRecord> &v) {
+    v.clear();
+    if (compressedSize == 0) {
+        return;
+    }
+    vector<char> &buffer = getInflateBuffer();
+    int uncompressedSize = inflateBlock(compressedBytes, compressedSize, buffer);
+    const char *uncompressedBytes = buffer.data();
+
+    // every record takes at least two bytes, which bounds the record count of a corrupt block
+    int nRecords = uncompressedSize < (int) sizeof(int) ? 0 : loadLittleEndian<int>(uncompressedBytes);
+    if (nRecords < 0 || nRecords > uncompressedSize / 2) nRecords = 0;
+    v.resize(nRecords);
+    recordSink sink(v);
+    if (!decodeRecords(uncompressedBytes, uncompressedSize, version, sink)) {
+        cerr << "Block is truncated or corrupt; read " << sink.count << " of " << nRecords << " records" << endl;
+    }
+    v.resize(sink.count);
+}
+
+vector<contactRecord> decodeBlock(char *compressedBytes, long compressedSize, int version) {
+    vector<contactRecord> v;
+    decodeBlock(compressedBytes, compressedSize, version, v);
+    return v;
+}
+
+// observed/expected of a contact, from its (normalized) count
+inline float expectedScale::apply(int binX, int binY, float counts) const {
+    double expectedCount = averageCount;
+    if (values) {
+        long distance = labs((long) binX - binY);
+        expectedCount = values->empty() ? NAN : (*values)[min(distance, (long) values->size() - 1)] / normFactor;
+    }
+    double ratio = counts / expectedCount;
+    return (float) (log ? std::log(ratio) : ratio);
+}
+
+// where decoded contacts land in a dense, row-major query result. rows and columns are the bins of
+// the first and second region as given by the user, which is the transpose of the stored
+// orientation when the first chromosome has the higher index
+template<class T>
+struct denseMatrix {
+    T *data;
+    long nCols;
+    long firstRow, lastRow, firstCol, lastCol; // bins, inclusive
+    bool xIsRow;
+    bool intra;
+    const vector<double> *c1Norm; // NULL when not normalizing
+    const vector<double> *c2Norm;
+    bool overExpected;
+    expectedScale expected;
+
+    // every contact has a cell, so there is nothing to check
+    bool reserve(long n) const {
+        return true;
+    }
+
+    void setColumns(int binY, const int *binX, const float *counts, int n) const {
+        for (int i = 0; i < n; i++) {
+            set(binX[i], binY, counts[i]);
+        }
+    }
+
+    // stores one contact, and its mirror image for intrachromosomal queries
+    void set(int binX, int binY, float counts) const {
+        if (c1Norm) {
+            counts = counts / ((*c1Norm)[binX] * (*c2Norm)[binY]);
+        }
+        if (overExpected) {
+            counts = expected.apply(binX, binY, counts);
+        }
+        long row = xIsRow ? binX : binY;
+        long col = xIsRow ? binY : binX;
+        if (row >= firstRow && row <= lastRow && col >= firstCol && col <= lastCol) {
+            data[(row - firstRow) * nCols + col - firstCol] = counts;
+        }
+        if (intra && binY >= firstRow && binY <= lastRow && binX >= firstCol && binX <= lastCol) {
+            data[(binY - firstRow) * nCols + binX - firstCol] = counts;
+        }
+    }
+
+    // stores the n cells of row binY of a type 2 block, starting at firstBinX. only the part of
+    // the row inside the matrix is visited, without per-cell bounds checks
+    template<class V>
+    void setRow(int binY, int firstBinX, const char *values, int n) const {
+        if (xIsRow) {
+            // binY is a column and the row runs down the matrix
+            if (binY >= firstCol && binY <= lastCol) {
+                long lo = max((long) firstBinX, firstRow);
+                long hi = min((long) firstBinX + n - 1, lastRow);
+                for (long binX = lo; binX <= hi; binX++) {
+                    store<V>(&data[(binX - firstRow) * nCols + binY - firstCol], values, binX - firstBinX, binX, binY);
+                }
+            }
+        } else if (binY >= firstRow && binY <= lastRow) {
+            long lo = max((long) firstBinX, firstCol);
+            long hi = min((long) firstBinX + n - 1, lastCol);
+            T *out = &data[(binY - firstRow) * nCols];
+            for (long binX = lo; binX <= hi; binX++) {
+                store<V>(&out[binX - firstCol], values, binX - firstBinX, binX, binY);
+            }
+        }
+        // mirror image: binY picks the row and the row runs along it
+        if (intra && binY >= firstRow && binY <= lastRow) {
+            long lo = max((long) firstBinX, firstCol);
+            long hi = min((long) firstBinX + n - 1, lastCol);
+            T *out = &data[(binY - firstRow) * nCols];
+            for (long binX = lo; binX <= hi; binX++) {
+                store<V>(&out[binX - firstCol], values, binX - firstBinX, binX, binY);
+            }
+        }
+    }
+
+    // copies value i of a type 2 row into out unless it is the empty-cell sentinel
+    template<class V>
+    void store(T *out, const char *values, long i, int binX, int binY) const {
+        V c = loadLittleEndian<V>(values + i * sizeof(V));
+        if (isEmptyCell(c)) return;
+        if (c1Norm) {
+            *out = (float) (c / ((*c1Norm)[binX] * (*c2Norm)[binY]));
+        } else {
+            *out = c;
+        }
+        if (overExpected) {
+            *out = expected.apply(binX, binY, (float) *out);
+        }
+    }
+};
+
+// decodes an uncompressed block straight into a dense matrix. sparse blocks go contact by
+// contact; dense (type 2) blocks are walked row by row over the columns that fall inside
+// the matrix, skipping the empty-cell sentinels
+template<class T>
+void decodeBlockIntoMatrix(const char *uncompressedBytes, int uncompressedSize, int version, const denseMatrix<T> &matrix) {
+    if (!decodeRecords(uncompressedBytes, uncompressedSize, version, matrix)) {
+        cerr << "Block is truncated or corrupt" << endl;
+    }
+}
+
+// number of records of a block, from the start of its compressed bytes
+int decodeSize(char *compressedBytes, long compressedSize) {
+    if (compressedSize == 0) {
+        return 0;
+    }
+    char header[sizeof(int)];
+    int uncompressedSize = inflatePrefix(compressedBytes, compressedSize, header, sizeof(int));
+    return uncompressedSize < (int) sizeof(int) ? 0 : loadLittleEndian<int>(header);
+}
+
+BlockCache::BlockCache(long capacity) {
+    this->capacity = capacity;
+    bytes = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+}
+
+// approximate memory held by one entry: the records, the key and the list and map nodes
+long BlockCache::entrySize(const cacheEntry &entry) {
+    return (long) (entry.second->capacity() * sizeof(contactRecord) + entry.first.size()) + 128;
+}
+
+// returns the cached block and marks it most recently used; an empty pointer if absent
+shared_ptr<const vector<contactRecord> > BlockCache::get(const string &key) {
+    lock_guard<std::mutex> lock(mutex);
+    unordered_map<string, list<cacheEntry>::iterator>::iterator it = entries.find(key);
+    if (it == entries.end()) {
+        misses++;
+        return shared_ptr<const vector<contactRecord> >();
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+void BlockCache::put(const string &key, shared_ptr<const vector<contactRecord> > block) {
+    lock_guard<std::mutex> lock(mutex);
+    cacheEntry entry(key, block);
+    if (entrySize(entry) > capacity) return;
+    unordered_map<string, list<cacheEntry>::iterator>::iterator it = entries.find(key);
+    if (it != entries.end()) {
+        // another thread decoded the same block first
+        lru.splice(lru.begin(), lru, it->second);
+        return;
+    }
+    lru.push_front(entry);
+    entries[key] = lru.begin();
+    bytes += entrySize(entry);
+    evict();
+}
+
+// drops least recently used entries until the cache fits its capacity; mutex must be held
+void BlockCache::evict() {
+    while (bytes > capacity && !lru.empty()) {
+        bytes -= entrySize(lru.back());
+        entries.erase(lru.back().first);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+void BlockCache::setCapacity(long capacity) {
+    lock_guard<std::mutex> lock(mutex);
+    this->capacity = capacity;
+    evict();
+}
+
+void BlockCache::clear() {
+    lock_guard<std::mutex> lock(mutex);
+    lru.clear();
+    entries.clear();
+    bytes = 0;
+}
+
+blockCacheStats BlockCache::getStats() {
+    lock_guard<std::mutex> lock(mutex);
+    blockCacheStats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.evictions = evictions;
+    stats.entries = (long) entries.size();
+    stats.bytes = bytes;
+    stats.capacity = capacity;
+    return stats;
+}
+
+// 256 MB by default; setBlockCacheCapacity(0) turns caching off
+BlockCache &getBlockCache() {
+    static BlockCache blockCache(256L * 1024 * 1024);
+    return blockCache;
+}
+
+void setBlockCacheCapacity(long capacity) {
+    getBlockCache().setCapacity(capacity);
+}
+
+void clearBlockCache() {
+    getBlockCache().clear();
+}
+
+blockCacheStats getBlockCacheStats() {
+    return getBlockCache().getStats();
+}
+
+ThreadPool::ThreadPool(int nThreads) {
+    stopping = false;
+    for (int i = 0; i < nThreads; i++) {
+        workers.push_back(thread(&ThreadPool::work, this));
+    }
+}
+
+// finishes the queued tasks, then joins the workers
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+future<void> ThreadPool::submit(function<void()> task) {
+    packaged_task<void()> packaged(task);
+    future<void> result = packaged.get_future();
+    {
+        lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(packaged));
+    }
+    condition.notify_one();
+    return result;
+}
+
+void ThreadPool::work() {
+    while (true) {
+        packaged_task<void()> task;
+        {
+            unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+static std::mutex threadPoolMutex;
+static int numThreads = max(1, (int) thread::hardware_concurrency());
+static shared_ptr<ThreadPool> threadPool;
+
+// queries in flight keep the pool they started with alive when the thread count changes
+shared_ptr<ThreadPool> getThreadPool() {
+    lock_guard<std::mutex> lock(threadPoolMutex);
+    if (!threadPool && numThreads > 1) {
+        threadPool = make_shared<ThreadPool>(numThreads);
+    }
+    return threadPool;
+}
+
+// number of threads used to decode blocks; 1 decodes on the calling thread. defaults to
+// the number of cores
+void setNumThreads(int nThreads) {
+    lock_guard<std::mutex> lock(threadPoolMutex);
+    numThreads = max(1, nThreads);
+    threadPool.reset();
+}
+
+int getNumThreads() {
+    lock_guard<std::mutex> lock(threadPoolMutex);
+    return numThreads;
+}
+
+static atomic<long> maxReadGap(64 * 1024);
+
+// blocks at most this many bytes apart in the file are fetched with one read, and the bytes between
+// them thrown away; a negative gap reads every block on its own
+void setMaxReadGap(long bytes) {
+    maxReadGap = bytes;
+}
+
+long getMaxReadGap() {
+    return maxReadGap;
+}
+
+RangeCache::RangeCache(string directory, long capacity) : directory(directory), capacity(capacity), bytes(0) {
+    load();
+}
+
+string RangeCache::chunkPath(const string &key, long chunk) const {
+    return directory + "/" + key + "/" + to_string(chunk);
+}
+
+bool RangeCache::get(const string &key, long chunk, char *data, long size) {
+    string path = chunkPath(key, chunk);
+    {
+        lock_guard<std::mutex> lock(mutex);
+        unordered_map<string, list<pair<string, long> >::iterator>::iterator it = entries.find(path);
+        if (it == entries.end() || it->second->second != size) return false;
+        lru.splice(lru.begin(), lru, it->second);
+    }
+    ifstream in(path.c_str(), ios::binary);
+    in.read(data, size);
+    if (in.gcount() != size) return false;
+#ifndef _WIN32
+    // so the next process that loads the cache sees it as recently used
+    utime(path.c_str(), NULL);
+#endif
+    return true;
+}
+
+void RangeCache::put(const string &key, long chunk, const char *data, long size) {
+    if (size > capacity) return;
+    string path = chunkPath(key, chunk);
+#ifndef _WIN32
+    mkdir((directory + "/" + key).c_str(), 0755);
+#endif
+    ostringstream tmp;
+    tmp << path << ".tmp" << hash<thread::id>()(this_thread::get_id());
+    {
+        ofstream out(tmp.str().c_str(), ios::binary);
+        out.write(data, size);
+        if (!out) {
+            cerr << "Could not write " << tmp.str() << " to the range cache" << endl;
+            remove(tmp.str().c_str());
+            return;
+        }
+    }
+    if (rename(tmp.str().c_str(), path.c_str()) != 0) {
+        remove(tmp.str().c_str());
+        return;
+    }
+
+    lock_guard<std::mutex> lock(mutex);
+    unordered_map<string, list<pair<string, long> >::iterator>::iterator it = entries.find(path);
+    if (it != entries.end()) {
+        bytes -= it->second->second;
+        lru.erase(it->second);
+    }
+    lru.push_front(make_pair(path, size));
+    entries[path] = lru.begin();
+    bytes += size;
+    evict();
+}
+
+// picks up chunks written by earlier runs, most recently used first by modification time
+void RangeCache::load() {
+#ifndef _WIN32
+    vector<pair<time_t, pair<string, long> > > found;
+    DIR *top = opendir(directory.c_str());
+    if (!top) return;
+    while (dirent *key = readdir(top)) {
+        if (key->d_name[0] == '.') continue;
+        string keyPath = directory + "/" + key->d_name;
+        DIR *sub = opendir(keyPath.c_str());
+        if (!sub) continue;
+        while (dirent *chunk = readdir(sub)) {
+            string path = keyPath + "/" + chunk->d_name;
+            struct stat st;
+            if (chunk->d_name[0] == '.' || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (string(chunk->d_name).find(".tmp") != string::npos) {
+                remove(path.c_str()); // left by a process that died while writing
+                continue;
+            }
+            found.push_back(make_pair(st.st_mtime, make_pair(path, (long) st.st_size)));
+        }
+        closedir(sub);
+    }
+    closedir(top);
+
+    sort(found.begin(), found.end());
+    lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < found.size(); i++) {
+        lru.push_front(found[i].second);
+        entries[found[i].second.first] = lru.begin();
+        bytes += found[i].second.second;
+    }
+    evict();
+#endif
+}
+
+// called with the mutex held
+void RangeCache::evict() {
+    while (bytes > capacity && !lru.empty()) {
+        const pair<string, long> &oldest = lru.back();
+        remove(oldest.first.c_str());
+        bytes -= oldest.second;
+        entries.erase(oldest.first);
+        lru.pop_back();
+    }
+}
+
+static std::mutex rangeCacheMutex;
+static shared_ptr<RangeCache> rangeCache;
+
+shared_ptr<RangeCache> getRangeCache() {
+    lock_guard<std::mutex> lock(rangeCacheMutex);
+    return rangeCache;
+}
+
+// keeps up to capacity bytes of fetched remote data in directory, which is created if missing, across runs.
+// an empty directory turns the cache off
+bool setHttpCacheDirectory(string directory, long capacity) {
+    lock_guard<std::mutex> lock(rangeCacheMutex);
+    rangeCache.reset();
+    if (directory.empty()) return true;
+#ifdef _WIN32
+    cerr << "The range cache is not supported on this platform" << endl;
+    return false;
+#else
+    struct stat st;
+    if (mkdir(directory.c_str(), 0755) != 0 && (stat(directory.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))) {
+        cerr << "Cache directory " << directory << " cannot be created" << endl;
+        return false;
+    }
+    rangeCache = make_shared<RangeCache>(directory, capacity);
+    return true;
+#endif
+}
+
+static std::atomic<int> maxHttpRequests(8);
+
+// number of range requests an HttpFetcher keeps in flight at once
+void setMaxHttpRequests(int requests) {
+    maxHttpRequests = max(1, requests);
+}
+
+int getMaxHttpRequests() {
+    return maxHttpRequests;
+}
+
+// one range request: the response body is copied straight into data, skipping the start of the
+// body if the server ignored the range and sent the whole resource
+struct HttpFetcher::transfer {
+    HttpFetcher *fetcher;
+    long position;
+    long size;
+    char *data;
+    long received;
+    long skip;
+    bool whole;
+};
+
+HttpFetcher::HttpFetcher(string url) : url(url), totalBytes(0), validated(false) {
+    multi = curl_multi_init();
+}
+
+HttpFetcher::~HttpFetcher() {
+    for (size_t i = 0; i < idle.size(); i++) {
+        curl_easy_cleanup(idle[i]);
+    }
+    if (multi) curl_multi_cleanup(multi);
+}
+
+// a handle from an earlier transfer when there is one, so its connection is kept
+CURL *HttpFetcher::getHandle() {
+    if (!idle.empty()) {
+        CURL *handle = idle.back();
+        idle.pop_back();
+        return handle;
+    }
+    CURL *handle = curl_easy_init();
+    if (handle) {
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(handle, CURLOPT_USERAGENT, "straw");
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCallback);
+        curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, headerCallback);
+    }
+    return handle;
+}
+
+size_t HttpFetcher::writeCallback(char *data, size_t size, size_t nmemb, void *userdata) {
+    transfer *t = (transfer *) userdata;
+    size_t n = size * nmemb;
+    size_t skipped = (size_t) min((long) n, t->skip);
+    t->skip -= skipped;
+    size_t wanted = (size_t) max(0L, min((long) (n - skipped), t->size - t->received));
+    memcpy(t->data + t->received, data + skipped, wanted);
+    t->received += wanted;
+    return n;
+}
+
+// the number a header value holds, or -1 if it is empty or malformed; strtol rather than stol,
+// since an exception must not unwind through libcurl's callback frames
+long parseHeaderLong(const char *value) {
+    char *end;
+    while (*value == ' ' || *value == '\t') value++;
+    if (!isdigit((unsigned char) *value)) return -1;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || (*end != '\0' && !isspace((unsigned char) *end))) return -1;
+    return number;
+}
+
+// picks the total size out of "Content-Range: bytes 0-100000/891471462". a 200 response means the
+// whole resource is coming: its Content-Length is the total size and the bytes before the range are skipped
+size_t HttpFetcher::headerCallback(char *data, size_t size, size_t nitems, void *userdata) {
+    transfer *t = (transfer *) userdata;
+    size_t n = size * nitems;
+    string line(data, n);
+    string name = line.substr(0, line.find(':'));
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (line.compare(0, 5, "HTTP/") == 0) {
+        size_t space = line.find(' ');
+        t->whole = space != string::npos && line.compare(space + 1, 3, "200") == 0;
+        t->skip = t->whole ? t->position : 0;
+    } else if (name == "content-length" && t->whole) {
+        long length = parseHeaderLong(line.c_str() + name.size() + 1);
+        if (length >= 0) t->fetcher->totalBytes = length;
+    } else if (name == "etag") {
+        t->fetcher->etag = line.substr(name.size() + 1);
+    } else if (name == "last-modified") {
+        t->fetcher->lastModified = line.substr(name.size() + 1);
+    } else if (name == "content-range") {
+        size_t slash = line.find('/');
+        long length = slash == string::npos ? -1 : parseHeaderLong(line.c_str() + slash + 1);
+        if (length >= 0) t->fetcher->totalBytes = length;
+    }
+    return n;
+}
+
+// requests the ranges over the network; complete tells which arrived in full, and the buffers of the
+// others are empty
+vector<shared_ptr<char> > HttpFetcher::fetchRanges(const vector<indexEntry> &ranges, vector<bool> &complete) {
+    vector<shared_ptr<char> > buffers(ranges.size());
+    vector<transfer> transfers(ranges.size());
+    complete.assign(ranges.size(), false);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        shared_ptr<vector<char> > bytes = getBytePool().acquire();
+        bytes->resize(max(0L, ranges[i].size));
+        buffers[i] = shared_ptr<char>(bytes, bytes->data());
+        transfer &t = transfers[i];
+        t.fetcher = this;
+        t.position = ranges[i].position;
+        t.size = ranges[i].size;
+        t.data = bytes->data();
+        t.received = 0;
+        t.skip = 0;
+        t.whole = false;
+    }
+    if (!multi) return vector<shared_ptr<char> >(ranges.size());
+
+    size_t next = 0;
+    int active = 0;
+    int maxActive = getMaxHttpRequests();
+    while (next < transfers.size() || active > 0) {
+        while (active < maxActive && next < transfers.size()) {
+            transfer &t = transfers[next++];
+            if (t.size <= 0) {
+                complete[&t - &transfers[0]] = true;
+                continue;
+            }
+            CURL *handle = getHandle();
+            if (!handle) {
+                cerr << "Could not start a request for " << url << endl;
+                continue;
+            }
+            ostringstream range;
+            range << t.position << "-" << t.position + t.size - 1;
+            curl_easy_setopt(handle, CURLOPT_RANGE, range.str().c_str());
+            curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *) &t);
+            curl_easy_setopt(handle, CURLOPT_HEADERDATA, (void *) &t);
+            curl_easy_setopt(handle, CURLOPT_PRIVATE, (void *) &t);
+            curl_multi_add_handle(multi, handle);
+            active++;
+        }
+
+        int running;
+        curl_multi_perform(multi, &running);
+        CURLMsg *message;
+        int queued;
+        while ((message = curl_multi_info_read(multi, &queued))) {
+            if (message->msg != CURLMSG_DONE) continue;
+            CURL *handle = message->easy_handle;
+            transfer *t;
+            curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **) &t);
+            // a range request is answered with 206, or with 200 and the whole resource by servers that ignore
+            // ranges; anything else (403, 404, 416, 5xx) has an error page for a body, not the bytes asked for
+            long status = 0;
+            curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+            // only the end of the resource may cut a range short
+            bool ended = t->received < t->size && totalBytes > 0 && t->position + t->received == totalBytes;
+            complete[t - &transfers[0]] = message->data.result == CURLE_OK && (status == 206 || status == 200) &&
+                                          (t->received == t->size || ended);
+            if (message->data.result != CURLE_OK) {
+                cerr << "Request for bytes " << t->position << "-" << t->position + t->size - 1 << " of " << url
+                     << " failed: " << curl_easy_strerror(message->data.result) << endl;
+            } else if (status != 206 && status != 200) {
+                cerr << "Request for bytes " << t->position << "-" << t->position + t->size - 1 << " of " << url
+                     << " failed with HTTP status " << status << endl;
+            } else if (!complete[t - &transfers[0]]) {
+                cerr << "Request for bytes " << t->position << "-" << t->position + t->size - 1 << " of " << url
+                     << " returned only " << t->received << " bytes" << endl;
+            }
+            curl_multi_remove_handle(multi, handle);
+            idle.push_back(handle);
+            active--;
+        }
+        if (active > 0) {
+            curl_multi_wait(multi, NULL, 0, 1000, NULL);
+        }
+    }
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (!complete[i]) buffers[i].reset();
+    }
+    return buffers;
+}
+
+// finds out which version of the resource this is with a HEAD request, which makes it cacheable
+void HttpFetcher::validate() {
+    validated = true;
+    CURL *handle = curl_easy_init();
+    if (!handle) return;
+    transfer t;
+    t.fetcher = this;
+    t.position = 0;
+    t.size = 0;
+    t.data = NULL;
+    t.received = 0;
+    t.skip = 0;
+    t.whole = false;
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_USERAGENT, "straw");
+    curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, headerCallback);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, (void *) &t);
+    CURLcode res = curl_easy_perform(handle);
+    curl_easy_cleanup(handle);
+
+    string version = etag.empty() ? lastModified : etag;
+    version.erase(version.find_last_not_of(" \r\n") + 1);
+    if (res != CURLE_OK || version.empty() || totalBytes <= 0) return;
+    // FNV-1a, which unlike std::hash is the same from one run to the next
+    unsigned long long hash = 14695981039346656037ULL;
+    string id = url + "\n" + version;
+    for (size_t i = 0; i < id.size(); i++) {
+        hash = (hash ^ (unsigned char) id[i]) * 1099511628211ULL;
+    }
+    ostringstream key;
+    key << hex << hash;
+    cacheKey = key.str();
+}
+
+vector<shared_ptr<char> > HttpFetcher::fetch(const vector<indexEntry> &ranges) {
+    shared_ptr<RangeCache> cache = getRangeCache();
+    if (cache) {
+        if (!validated) validate();
+        if (!cacheKey.empty()) return fetchCached(*cache, ranges);
+    }
+    vector<bool> complete;
+    return fetchRanges(ranges, complete);
+}
+
+// serves the ranges from the chunks that cover them, fetching missing chunks (runs of adjacent ones
+// in one request) and adding them to the cache
+vector<shared_ptr<char> > HttpFetcher::fetchCached(RangeCache &cache, const vector<indexEntry> &ranges) {
+    const long chunkSize = RangeCache::chunkSize;
+    const long maxRunChunks = 64;
+    map<long, shared_ptr<vector<char> > > chunks;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        long end = min(ranges[i].position + ranges[i].size, totalBytes);
+        for (long c = ranges[i].position / chunkSize; c * chunkSize < end; c++) {
+            chunks[c];
+        }
+    }
+
+    vector<long> missing;
+    for (map<long, shared_ptr<vector<char> > >::iterator it = chunks.begin(); it != chunks.end(); ++it) {
+        long size = min(chunkSize, totalBytes - it->first * chunkSize);
+        it->second = getBytePool().acquire();
+        it->second->resize(size);
+        if (!cache.get(cacheKey, it->first, it->second->data(), size)) missing.push_back(it->first);
+    }
+
+    vector<indexEntry> runs;
+    vector<long> runFirst;
+    for (size_t i = 0; i < missing.size(); i++) {
+        long size = (long) chunks[missing[i]]->size();
+        if (!runs.empty() && missing[i] == missing[i - 1] + 1 && runs.back().size < maxRunChunks * chunkSize) {
+            runs.back().size += size;
+            continue;
+        }
+        indexEntry run;
+        run.position = missing[i] * chunkSize;
+        run.size = size;
+        runs.push_back(run);
+        runFirst.push_back(missing[i]);
+    }
+    vector<bool> complete;
+    vector<shared_ptr<char> > fetched = fetchRanges(runs, complete);
+    for (size_t r = 0; r < runs.size(); r++) {
+        for (long offset = 0, c = runFirst[r]; offset < runs[r].size; offset += chunkSize, c++) {
+            if (!complete[r]) {
+                chunks[c].reset();
+                continue;
+            }
+            vector<char> &chunk = *chunks[c];
+            memcpy(chunk.data(), fetched[r].get() + offset, chunk.size());
+            cache.put(cacheKey, c, chunk.data(), (long) chunk.size());
+        }
+    }
+
+    // ranges that need a chunk which could not be fetched are left empty
+    vector<shared_ptr<char> > buffers(ranges.size());
+    for (size_t i = 0; i < ranges.size(); i++) {
+        bool fetchedAll = true;
+        long end = min(ranges[i].position + ranges[i].size, totalBytes);
+        for (long c = ranges[i].position / chunkSize; c * chunkSize < end; c++) {
+            fetchedAll = fetchedAll && chunks[c];
+        }
+        if (!fetchedAll) continue;
+        shared_ptr<vector<char> > bytes = getBytePool().acquire();
+        bytes->resize(max(0L, ranges[i].size));
+        buffers[i] = shared_ptr<char>(bytes, bytes->data());
+        for (long c = ranges[i].position / chunkSize; c * chunkSize < end; c++) {
+            long from = max(ranges[i].position, c * chunkSize);
+            long to = min(end, (c + 1) * chunkSize);
+            memcpy(bytes->data() + (from - ranges[i].position), chunks[c]->data() + (from - c * chunkSize), to - from);
+        }
+    }
+    return buffers;
+}
+
+shared_ptr<char> HttpFetcher::fetch(long position, long size) {
+    indexEntry range;
+    range.position = position;
+    range.size = size;
+    return fetch(vector<indexEntry>(1, range))[0];
+}
+
+HiCFile::HiCFile(string fileName) {
+    this->fileName = fileName;
+    isHttp = false;
+    mapped = NULL;
+    mappedSize = 0;
+    version = 0;
+    master = -1;
+    totalBytes = 0;
+    valid = false;
+    expectedValuesIndexed = false;
+    long nviPosition = -1, nviLength = -1;
+
+    // HTTP code
+    string prefix = "http";
+    if (std::strncmp(fileName.c_str(), prefix.c_str(), prefix.size()) == 0) {
+        isHttp = true;
+        http.reset(new HttpFetcher(fileName));
+        if (!http->isValid()) {
+            cerr << "URL " << fileName << " cannot be opened for reading" << endl;
+            return;
+        }
+        // the header is fetched as far as it runs, however many chromosomes it lists
+        rangebuf sbuf(*http, 0, numeric_limits<long>::max());
+        istream bufin(&sbuf);
+        chromosomeMap = readHeader(bufin, master, version, nviPosition, nviLength);
+        totalBytes = http->getTotalBytes();
+    } else if (mapFile()) {
+        // local files are memory-mapped; everything below reads straight from the mapping
+        membuf sbuf(mapped, mapped + mappedSize);
+        istream bufin(&sbuf);
+        chromosomeMap = readHeader(bufin, master, version, nviPosition, nviLength);
+        totalBytes = mappedSize;
+    } else {
+        fin.open(fileName, fstream::in);
+        if (!fin) {
+            cerr << "File " << fileName << " cannot be opened for reading" << endl;
+            return;
+        }
+        chromosomeMap = readHeader(fin, master, version, nviPosition, nviLength);
+        fin.seekg(0, ios::end);
+        totalBytes = fin.tellg();
+    }
+    if (master < 0) return;
+
+    // the footer is parsed once; queries then look up matrices and normalization
+    // vectors in masterIndex and normVectorIndex. v9 headers point at the norm vector
+    // index, so only the master index is read from the footer itself
+    bool hasNvi = version > 8 && nviPosition > 0 && nviLength > 0 && nviPosition + nviLength <= totalBytes;
+    if (isHttp) {
+        // only the master index and the norm vector index are fetched; the expected values
+        // between them are seeked over
+        rangebuf sbuf2(*http, master, totalBytes);
+        istream bufin2(&sbuf2);
+        valid = hasNvi ? readMasterIndex(bufin2, version, masterIndex)
+                       : readFooter(bufin2, version, masterIndex, normVectorIndex);
+    } else if (mapped) {
+        if (master > mappedSize) {
+            cerr << "Master index position is past the end of " << fileName << endl;
+            return;
+        }
+        membuf sbuf2(mapped + master, mapped + mappedSize);
+        istream bufin2(&sbuf2);
+        valid = hasNvi ? readMasterIndex(bufin2, version, masterIndex)
+                       : readFooter(bufin2, version, masterIndex, normVectorIndex);
+    } else {
+        fin.seekg(master, ios::beg);
+        valid = hasNvi ? readMasterIndex(fin, version, masterIndex)
+                       : readFooter(fin, version, masterIndex, normVectorIndex);
+        fin.clear();
+    }
+    if (valid && hasNvi) {
+        shared_ptr<char> buffer = readBytes(nviPosition, nviLength);
+        if (!buffer) {
+            valid = false;
+            return;
+        }
+        membuf sbuf3(buffer.get(), buffer.get() + nviLength);
+        istream bufin3(&sbuf3);
+        valid = readNormVectorIndex(bufin3, version, normVectorIndex);
+        fin.clear();
+    }
+}
+
+HiCFile::~HiCFile() {
+#ifndef _WIN32
+    if (mapped) munmap(mapped, mappedSize);
+#endif
+}
+
+// maps a local file read-only into memory; returns false, leaving reads to the ifstream,
+// where mmap is not available or fails
+bool HiCFile::mapFile() {
+    mapped = NULL;
+    mappedSize = 0;
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *address = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            mapped = static_cast<char *>(address);
+            mappedSize = st.st_size;
+        }
+    }
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+#endif
+    return mapped != NULL;
+}
+
+// returns size bytes from position, or an empty pointer when they cannot be read. for mapped files the
+// pointer is into the mapping and nothing is copied; otherwise the bytes are read into a buffer the pointer owns
+shared_ptr<char> HiCFile::readBytes(long position, long size) {
+    if (mapped && position >= 0 && position + size <= mappedSize) {
+        return shared_ptr<char>(mapped + position, [](char *) {});
+    }
+    lock_guard<recursive_mutex> lock(fileMutex);
+    if (http) {
+        return http->fetch(position, size);
+    }
+    if (mapped) {
+        cerr << "Read of " << size << " bytes at " << position << " is past the end of " << fileName << endl;
+        return shared_ptr<char>();
+    }
+    shared_ptr<vector<char> > bytes = getBytePool().acquire();
+    bytes->resize(size);
+    fin.seekg(position, ios::beg);
+    if (!fin.read(bytes->data(), size)) {
+        cerr << "Read of " << size << " bytes at " << position << " failed in " << fileName << endl;
+        fin.clear();
+        return shared_ptr<char>();
+    }
+    return shared_ptr<char>(bytes, bytes->data());
+}
+
+// reads the compressed bytes of several blocks, in file order and merging the reads of blocks no more than
+// getMaxReadGap() apart, so that seeks and HTTP round trips are paid per run of nearby blocks. each pointer
+// shares its run's buffer. false if any block could not be read; its pointer is then empty
+bool HiCFile::readBlocks(const vector<indexEntry> &entries, vector<shared_ptr<char> > &blocks) {
+    // merged reads stop growing here, unless a single block is bigger
+    const long maxReadSize = 16 * 1024 * 1024;
+    blocks.assign(entries.size(), shared_ptr<char>());
+    vector<size_t> order(entries.size());
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&entries](size_t a, size_t b) {
+        return entries[a].position < entries[b].position;
+    });
+
+    // runs of nearby blocks, as positions into order, and the byte range of each
+    vector<size_t> runStarts;
+    vector<indexEntry> runs;
+    long maxGap = getMaxReadGap();
+    for (size_t first = 0, last; first < order.size(); first = last) {
+        long start = entries[order[first]].position;
+        long end = start + entries[order[first]].size;
+        for (last = first + 1; last < order.size(); last++) {
+            const indexEntry &next = entries[order[last]];
+            long nextEnd = max(end, next.position + next.size);
+            if (maxGap < 0 || next.position - end > maxGap || nextEnd - start > maxReadSize) break;
+            end = nextEnd;
+        }
+        indexEntry run;
+        run.position = start;
+        run.size = end - start;
+        runStarts.push_back(first);
+        runs.push_back(run);
+    }
+    runStarts.push_back(order.size());
+
+    // over http the runs are fetched concurrently
+    vector<shared_ptr<char> > runBytes;
+    if (http) {
+        lock_guard<recursive_mutex> lock(fileMutex);
+        runBytes = http->fetch(runs);
+    } else {
+        for (size_t r = 0; r < runs.size(); r++) {
+            runBytes.push_back(readBytes(runs[r].position, runs[r].size));
+        }
+    }
+    bool ok = true;
+    for (size_t r = 0; r < runs.size(); r++) {
+        if (!runBytes[r]) {
+            ok = false;
+            continue;
+        }
+        for (size_t i = runStarts[r]; i < runStarts[r + 1]; i++) {
+            long offset = entries[order[i]].position - runs[r].position;
+            blocks[order[i]] = shared_ptr<char>(runBytes[r], runBytes[r].get() + offset);
+        }
+    }
+    if (!ok) cerr << "Blocks of " << fileName << " could not be read" << endl;
+    return ok;
+}
+
+// parses <chr>[:x1:x2] for both chromosomes, orders them by chromosome index and sets
+// the region in base pairs (origRegionIndices) and in bins (regionIndices)
+bool HiCFile::parseRegion(string chr1loc, string chr2loc, int binsize, int &c1, int &c2,
+                          long *origRegionIndices, long *regionIndices) {
+    // parse chromosome positions
+    stringstream ss(chr1loc);
+    string chr1, chr2, x, y;
+    long c1pos1 = -100, c1pos2 = -100, c2pos1 = -100, c2pos2 = -100;
+    getline(ss, chr1, ':');
+    if (chromosomeMap.count(chr1) == 0) {
+        cerr << chr1 << " not found in the file." << endl;
+        return false;
+    }
+
+    if (getline(ss, x, ':') && getline(ss, y, ':')) {
+        c1pos1 = stol(x);
+        c1pos2 = stol(y);
+    } else {
+        c1pos1 = 0;
+        c1pos2 = chromosomeMap[chr1].length;
+    }
+    stringstream ss1(chr2loc);
+    getline(ss1, chr2, ':');
+    if (chromosomeMap.count(chr2) == 0) {
+        cerr << chr2 << " not found in the file." << endl;
+        return false;
+    }
+
+    if (getline(ss1, x, ':') && getline(ss1, y, ':')) {
+        c2pos1 = stol(x);
+        c2pos2 = stol(y);
+    } else {
+        c2pos1 = 0;
+        c2pos2 = chromosomeMap[chr2].length;
+    }
+
+    // from header have size of chromosomes, set region to read
+    c1 = min(chromosomeMap[chr1].index, chromosomeMap[chr2].index);
+    c2 = max(chromosomeMap[chr1].index, chromosomeMap[chr2].index);
     // reverse order if necessary
     if (chromosomeMap[chr1].index > chromosomeMap[chr2].index) {
         origRegionIndices[0] = c2pos1;
@@ -925,294 +2079,1743 @@ vector<contactRecord> straw(string norm, string fname, string chr1loc, string ch
         origRegionIndices[2] = c2pos1;
         origRegionIndices[3] = c2pos2;
     }
-    long regionIndices[4]; // used to find the blocks we need to access
-    regionIndices[0] = origRegionIndices[0] / binsize;
-    regionIndices[1] = origRegionIndices[1] / binsize;
-    regionIndices[2] = origRegionIndices[2] / binsize;
-    regionIndices[3] = origRegionIndices[3] / binsize;
+    for (int i = 0; i < 4; i++) {
+        regionIndices[i] = origRegionIndices[i] / binsize;
+    }
+    return true;
+}
+
+// bins of a normalization vector read at a time
+static const long normVectorChunk = 4096;
+
+// returns the normalization vector for chromosome chrIdx, with at least bins firstBin to lastBin
+// read through the normalization vector index; only the chunks of bins a query reaches are read,
+// so the rest of the vector stays NaN. NULL if the file does not have it
+shared_ptr<const vector<double> > HiCFile::getNormVector(string norm, int chrIdx, string unit, int binsize,
+                                                         long firstBin, long lastBin) {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    string key = getNormKey(norm, chrIdx, unit, binsize);
+    unordered_map<string, indexEntry>::iterator it = normVectorIndex.find(key);
+    if (it == normVectorIndex.end()) {
+        return NULL;
+    }
+    // a count (long in v9, int before) then fixed-width values (float in v9, double before), so
+    // the length follows from the entry size and any bin can be read on its own
+    long countSize = version > 8 ? sizeof(long) : sizeof(int);
+    long valueSize = version > 8 ? sizeof(float) : sizeof(double);
+    shared_ptr<normVector> &cached = normVectorCache[key];
+    if (!cached) {
+        long nValues = max(0L, (it->second.size - countSize) / valueSize);
+        cached = make_shared<normVector>();
+        cached->values.assign(nValues, numeric_limits<double>::quiet_NaN());
+        cached->loaded.assign((nValues + normVectorChunk - 1) / normVectorChunk, false);
+    }
+    normVector &cachedNorm = *cached;
+    shared_ptr<const vector<double> > values(cached, &cached->values);
+
+    firstBin = max(0L, firstBin);
+    lastBin = min(lastBin, (long) cachedNorm.values.size() - 1);
+    if (firstBin > lastBin) {
+        return values;
+    }
+    long firstChunk = firstBin / normVectorChunk;
+    long lastChunk = lastBin / normVectorChunk;
+    while (firstChunk <= lastChunk && cachedNorm.loaded[firstChunk]) firstChunk++;
+    while (lastChunk >= firstChunk && cachedNorm.loaded[lastChunk]) lastChunk--;
+    if (firstChunk > lastChunk) {
+        return values;
+    }
+
+    long first = firstChunk * normVectorChunk;
+    long count = min((long) cachedNorm.values.size(), (lastChunk + 1) * normVectorChunk) - first;
+    shared_ptr<char> buffer = readBytes(it->second.position + countSize + first * valueSize, count * valueSize);
+    if (!buffer) return NULL;
+    const char *p = buffer.get();
+    for (long i = 0; i < count; i++, p += valueSize) {
+        cachedNorm.values[first + i] = version > 8 ? (double) loadLittleEndian<float>(p) : loadLittleEndian<double>(p);
+    }
+    for (long c = firstChunk; c <= lastChunk; c++) {
+        cachedNorm.loaded[c] = true;
+    }
+    fin.clear();
+    return values;
+}
+
+// walks the expected value maps after the master index on first use of observed/expected, keeping where
+// each vector's values are, without reading them, and its per-chromosome normalization factors
+void HiCFile::readExpectedValueIndex() {
+    expectedValuesIndexed = true;
+    unique_ptr<streambuf> buffer;
+    if (http) {
+        buffer.reset(new rangebuf(*http, 0, totalBytes));
+    } else if (mapped) {
+        buffer.reset(new membuf(mapped, mapped + mappedSize));
+    }
+    istream in(buffer ? buffer.get() : fin.rdbuf());
+    in.seekg(master, ios::beg);
+    unordered_map<string, indexEntry> skippedMasterIndex;
+    if (!readMasterIndex(in, version, skippedMasterIndex)) return;
+
+    long valueSize = version > 8 ? sizeof(float) : sizeof(double);
+    // raw expected values first, then one map per normalization type
+    for (int section = 0; section < 2; section++) {
+        int nExpectedValues = readIntFromFile(in);
+        for (int i = 0; i < nExpectedValues && in; i++) {
+            string norm = "NONE", unit;
+            if (section == 1) getline(in, norm, '\0');
+            getline(in, unit, '\0');
+            int binSize = readIntFromFile(in);
+            long nValues = version > 8 ? readLongFromFile(in) : (long) readIntFromFile(in);
+            if (!in || nValues < 0) break;
+
+            expectedValues &values = expectedValueIndex[getExpectedKey(norm, unit, binSize)];
+            values.entry.position = in.tellg();
+            values.entry.size = nValues * valueSize;
+            in.seekg(values.entry.size, ios::cur);
+            int nNormalizationFactors = readIntFromFile(in);
+            for (int j = 0; j < nNormalizationFactors && in; j++) {
+                int chrIdx = readIntFromFile(in);
+                values.normFactors[chrIdx] = version > 8 ? readFloatFromFile(in) : readDoubleFromFile(in);
+            }
+        }
+    }
+    fin.clear();
+}
+
+// returns the expected values of a normalization ("NONE" for raw counts) at unit and binsize, reading
+// them on first use; NULL if the file does not have them
+const expectedValues *HiCFile::getExpectedValues(string norm, string unit, int binsize) {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    if (!expectedValuesIndexed) {
+        readExpectedValueIndex();
+    }
+    unordered_map<string, expectedValues>::iterator it = expectedValueIndex.find(getExpectedKey(norm, unit, binsize));
+    if (it == expectedValueIndex.end()) {
+        return NULL;
+    }
+    expectedValues &values = it->second;
+    if (!values.values) {
+        long valueSize = version > 8 ? sizeof(float) : sizeof(double);
+        long nValues = values.entry.size / valueSize;
+        shared_ptr<char> buffer = readBytes(values.entry.position, values.entry.size);
+        if (!buffer) return NULL;
+        shared_ptr<vector<double> > read = make_shared<vector<double> >(nValues);
+        const char *p = buffer.get();
+        for (long i = 0; i < nValues; i++, p += valueSize) {
+            (*read)[i] = version > 8 ? (double) loadLittleEndian<float>(p) : loadLittleEndian<double>(p);
+        }
+        values.values = read;
+        fin.clear();
+    }
+    return &values;
+}
+
+// sets up observed/expected for a query: intrachromosomal contacts are divided by the expected count at
+// their distance, scaled by the chromosome's normalization factor; interchromosomal contacts, which the
+// footer has no expected values for, by the average count of the matrix
+bool HiCFile::prepareExpected(string matrixType, string norm, string unit, int binsize,
+                              const matrixZoomData &zoomData, recordQuery &query) {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    expectedScale &expected = query.expected;
+    expected.values.reset();
+    expected.normFactor = 1;
+    expected.averageCount = 0;
+    expected.log = matrixType == "log_oe";
+    if (query.c1 != query.c2) {
+        long nBins1 = 1, nBins2 = 1;
+        for (map<string, chromosome>::const_iterator it = chromosomeMap.begin(); it != chromosomeMap.end(); ++it) {
+            if (it->second.index == query.c1) nBins1 = max(1L, it->second.length / binsize);
+            if (it->second.index == query.c2) nBins2 = max(1L, it->second.length / binsize);
+        }
+        expected.averageCount = (double) zoomData.sumCounts / nBins1 / nBins2;
+        return true;
+    }
+
+    const expectedValues *values = getExpectedValues(norm, unit, binsize);
+    if (values == NULL) {
+        cerr << "File did not contain " << norm << " expected values at " << binsize << " " << unit << endl;
+        return false;
+    }
+    expected.values = values->values;
+    map<int, double>::const_iterator factor = values->normFactors.find(query.c1);
+    if (factor != values->normFactors.end()) {
+        expected.normFactor = factor->second;
+    }
+    return true;
+}
+
+// returns the block index of the c1_c2 matrix at unit and binsize, reading it from the
+// matrix header on first use; NULL if the file does not have it
+shared_ptr<const matrixZoomData> HiCFile::getZoomData(int c1, int c2, string unit, int binsize) {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    stringstream zoomKey;
+    zoomKey << c1 << "_" << c2 << "_" << unit << "_" << binsize;
+    unordered_map<string, shared_ptr<const matrixZoomData> >::iterator cached = zoomDataCache.find(zoomKey.str());
+    if (cached != zoomDataCache.end()) {
+        return cached->second;
+    }
+
+    shared_ptr<const vector<zoomLevel> > levels = getMatrixResolutions(c1, c2);
+    if (levels == NULL) {
+        return NULL;
+    }
+    const zoomLevel *level = NULL;
+    for (size_t i = 0; i < levels->size(); i++) {
+        if ((*levels)[i].unit == unit && (*levels)[i].binSize == binsize) level = &(*levels)[i];
+    }
+    if (level == NULL) {
+        cerr << "Error finding block data" << endl;
+        return NULL;
+    }
+
+    // the resolution's block index is read in one go, straight from where its header says it is
+    long indexSize = level->nBlocks * (sizeof(int) + sizeof(long) + sizeof(int));
+    shared_ptr<char> buffer = readBytes(level->indexPosition, indexSize);
+    if (!buffer) return NULL;
+    membuf sbuf(buffer.get(), buffer.get() + indexSize);
+    istream bufin(&sbuf);
+    shared_ptr<matrixZoomData> read = make_shared<matrixZoomData>();
+    matrixZoomData &stored = *read;
+    stored.sumCounts = level->sumCounts;
+    stored.blockBinCount = level->blockBinCount;
+    stored.blockColumnCount = level->blockColumnCount;
+    stored.blockNumbers.resize(level->nBlocks);
+    stored.blockEntries.resize(level->nBlocks);
+    for (int b = 0; b < level->nBlocks; b++) {
+        stored.blockNumbers[b] = readIntFromFile(bufin);
+        stored.blockEntries[b].position = readLongFromFile(bufin);
+        stored.blockEntries[b].size = (long) readIntFromFile(bufin);
+    }
+    sortBlockIndex(stored);
+    zoomDataCache[zoomKey.str()] = read;
+    return read;
+}
+
+// the resolutions of matrix c1_c2, read from the matrix header on first use
+shared_ptr<const vector<zoomLevel> > HiCFile::getMatrixResolutions(int c1, int c2) {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    stringstream ss;
+    ss << c1 << "_" << c2;
+    string key = ss.str();
+    unordered_map<string, shared_ptr<const vector<zoomLevel> > >::iterator cached = matrixResolutions.find(key);
+    if (cached != matrixResolutions.end()) {
+        return cached->second;
+    }
+
+    unordered_map<string, indexEntry>::iterator it = masterIndex.find(key);
+    if (it == masterIndex.end()) {
+        cerr << "File doesn't have the given chr_chr map " << key << endl;
+        return NULL;
+    }
+
+    unique_ptr<streambuf> buffer;
+    if (http) {
+        buffer.reset(new rangebuf(*http, 0, totalBytes));
+    } else if (mapped) {
+        buffer.reset(new membuf(mapped, mapped + mappedSize));
+    }
+    istream in(buffer ? buffer.get() : fin.rdbuf());
+    shared_ptr<vector<zoomLevel> > levels = make_shared<vector<zoomLevel> >();
+    if (!readMatrixResolutions(in, it->second.position, *levels)) {
+        return NULL;
+    }
+    matrixResolutions[key] = levels;
+    return levels;
+}
+
+// bin sizes of matrix chr1_chr2 in the given unit, finest first. loci after the chromosome names are ignored
+vector<int> HiCFile::getResolutions(string chr1, string chr2, string unit) {
+    vector<int> resolutions;
+    chr1 = chr1.substr(0, chr1.find(':'));
+    chr2 = chr2.substr(0, chr2.find(':'));
+    if (!valid) {
+        cerr << "File " << fileName << " could not be read" << endl;
+        return resolutions;
+    }
+    if (chromosomeMap.count(chr1) == 0 || chromosomeMap.count(chr2) == 0) {
+        cerr << (chromosomeMap.count(chr1) ? chr2 : chr1) << " not found in the file." << endl;
+        return resolutions;
+    }
+    int c1 = min(chromosomeMap[chr1].index, chromosomeMap[chr2].index);
+    int c2 = max(chromosomeMap[chr1].index, chromosomeMap[chr2].index);
+    shared_ptr<const vector<zoomLevel> > levels = getMatrixResolutions(c1, c2);
+    if (levels == NULL) {
+        return resolutions;
+    }
+    for (size_t i = 0; i < levels->size(); i++) {
+        if ((*levels)[i].unit == unit) resolutions.push_back((*levels)[i].binSize);
+    }
+    sort(resolutions.begin(), resolutions.end());
+    resolutions.erase(unique(resolutions.begin(), resolutions.end()), resolutions.end());
+    return resolutions;
+}
+
+// the finest bin size at which the query has at most maxPixels cells and, when maxContacts is positive, at most
+// maxContacts contacts by getSize; the coarsest bin size if none does, 0 if the matrix has no resolutions
+int HiCFile::pickResolution(string chr1loc, string chr2loc, string unit, long maxPixels, long maxContacts) {
+    vector<int> resolutions = getResolutions(chr1loc, chr2loc, unit);
+    for (size_t i = 0; i < resolutions.size(); i++) {
+        long nRows, nCols;
+        if (!getMatrixShape(chr1loc, chr2loc, resolutions[i], nRows, nCols)) {
+            return 0;
+        }
+        if (nRows * nCols > maxPixels) continue;
+        if (maxContacts > 0 && getSize("NONE", chr1loc, chr2loc, unit, resolutions[i]) > maxContacts) continue;
+        return resolutions[i];
+    }
+    return resolutions.empty() ? 0 : resolutions.back();
+}
+
+// contacts of the query summed into bins of binsize, which need not be a resolution of the file: the records
+// are read at the coarsest resolution that divides binsize and added up in double precision, skipping
+// normalized contacts without a value. coarse bins cut by the edges of the region only sum the part inside it.
+// only observed contacts are summed: a sum of observed/expected ratios is not the ratio of the coarse bin
+vector<contactRecord> HiCFile::getAggregatedRecords(string norm, string chr1loc, string chr2loc, string unit,
+                                                    int binsize, string matrixType) {
+    vector<contactRecord> records;
+    if (matrixType != "observed") {
+        cerr << "Matrix type " << matrixType << " cannot be aggregated, only observed contacts can" << endl;
+        return records;
+    }
+    vector<int> resolutions = getResolutions(chr1loc, chr2loc, unit);
+    int native = 0;
+    for (size_t i = 0; i < resolutions.size(); i++) {
+        if (binsize > 0 && binsize % resolutions[i] == 0) native = resolutions[i];
+    }
+    if (native == 0) {
+        cerr << "Bin size " << binsize << " " << unit << " is not a multiple of any resolution in the file" << endl;
+        return records;
+    }
+    vector<contactRecord> nativeRecords = getRecords(norm, chr1loc, chr2loc, unit, native, matrixType);
+    if (native == binsize) {
+        return nativeRecords;
+    }
+
+    // each record is moved to its bin and sorted next to the others of that bin, then each run is summed
+    size_t n = 0;
+    for (vector<contactRecord>::const_iterator it = nativeRecords.begin(); it != nativeRecords.end(); ++it) {
+        if (it->counts != it->counts) continue;
+        contactRecord record = *it;
+        record.binX = record.binX / binsize * binsize;
+        record.binY = record.binY / binsize * binsize;
+        nativeRecords[n++] = record;
+    }
+    nativeRecords.resize(n);
+    sort(nativeRecords.begin(), nativeRecords.end(), [](const contactRecord &a, const contactRecord &b) {
+        return a.binX < b.binX || (a.binX == b.binX && a.binY < b.binY);
+    });
+    for (size_t first = 0, last; first < n; first = last) {
+        double sum = 0;
+        for (last = first; last < n && nativeRecords[last].binX == nativeRecords[first].binX &&
+                           nativeRecords[last].binY == nativeRecords[first].binY; last++) {
+            sum += nativeRecords[last].counts;
+        }
+        contactRecord record = nativeRecords[first];
+        record.counts = (float) sum;
+        records.push_back(record);
+    }
+    return records;
+}
+
+// key of a block in the shared block cache
+string HiCFile::getBlockKey(int c1, int c2, string unit, int binsize, int blockNumber) {
+    stringstream ss;
+    ss << fileName << "|" << c1 << "_" << c2 << "_" << unit << "_" << binsize << "|" << blockNumber;
+    return ss.str();
+}
+
+BlockReader::BlockReader(HiCFile &file, int c1, int c2, string unit, int binsize, const set<int> &blockNumbers,
+                         shared_ptr<const matrixZoomData> zoomData)
+        : file(file), c1(c1), c2(c2), unit(unit), binsize(binsize), blockNumbers(blockNumbers),
+          zoomData(zoomData), pool(getThreadPool()), readFailed(false) {
+    nextBlock = this->blockNumbers.begin();
+    maxPending = pool ? 4 * (size_t) pool->size() : 0;
+    readAhead = max((size_t) 64, maxPending + 1);
+}
+
+BlockReader::~BlockReader() {
+    for (deque<pendingBlock>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        if (it->done.valid()) it->done.wait();
+    }
+}
+
+// looks up the next blocks in the cache and reads the compressed bytes of those missing with one
+// coalesced read
+void BlockReader::fetch() {
+    BlockCache &blockCache = getBlockCache();
+    vector<indexEntry> entries;
+    vector<size_t> toRead;
+    while (nextBlock != blockNumbers.end() && entries.size() < readAhead) {
+        fetchedBlock block;
+        block.blockNumber = *nextBlock++;
+        if (!zoomData->findBlock(block.blockNumber, block.idx)) continue;
+        block.key = file.getBlockKey(c1, c2, unit, binsize, block.blockNumber);
+        block.cached = blockCache.get(block.key);
+        if (!block.cached) {
+            toRead.push_back(fetched.size());
+            entries.push_back(block.idx);
+        }
+        fetched.push_back(block);
+    }
+    vector<shared_ptr<char> > bytes;
+    if (!file.readBlocks(entries, bytes)) {
+        // the blocks already decoding are still returned, then nothing more
+        readFailed = true;
+        fetched.clear();
+        nextBlock = blockNumbers.end();
+        return;
+    }
+    for (size_t i = 0; i < toRead.size(); i++) {
+        fetched[toRead[i]].compressedBytes = bytes[i];
+    }
+}
+
+// starts decoding a fetched block: on the thread pool, or right here without a pool
+void BlockReader::schedule(const fetchedBlock &fetchedBlock) {
+    pendingBlock next;
+    next.blockNumber = fetchedBlock.blockNumber;
+    next.block = make_shared<shared_ptr<const vector<contactRecord> > >(fetchedBlock.cached);
+    if (!*next.block) {
+        BlockCache &blockCache = getBlockCache();
+        shared_ptr<char> compressedBytes = fetchedBlock.compressedBytes;
+        shared_ptr<shared_ptr<const vector<contactRecord> > > block = next.block;
+        indexEntry idx = fetchedBlock.idx;
+        string key = fetchedBlock.key;
+        int version = file.version;
+        function<void()> decode = [block, &blockCache, compressedBytes, idx, version, key]() {
+            shared_ptr<vector<contactRecord> > records = getRecordPool().acquire();
+            decodeBlock(compressedBytes.get(), idx.size, version, *records);
+            *block = records;
+            blockCache.put(key, *block);
+        };
+        if (pool) {
+            next.done = pool->submit(decode);
+        } else {
+            decode();
+        }
+    }
+    pending.push_back(std::move(next));
+}
+
+shared_ptr<const vector<contactRecord> > BlockReader::next() {
+    int blockNumber;
+    return next(blockNumber);
+}
+
+shared_ptr<const vector<contactRecord> > BlockReader::next(int &blockNumber) {
+    while (pending.size() <= maxPending) {
+        if (fetched.empty()) fetch();
+        if (fetched.empty()) break;
+        schedule(fetched.front());
+        fetched.pop_front();
+    }
+    if (pending.empty()) {
+        return shared_ptr<const vector<contactRecord> >();
+    }
+    if (pending.front().done.valid()) pending.front().done.wait();
+    shared_ptr<const vector<contactRecord> > block = *pending.front().block;
+    blockNumber = pending.front().blockNumber;
+    pending.pop_front();
+    return block;
+}
+
+// drops the block indices, resolutions, norm vectors and expected values read so far. queries already
+// running keep what they hold
+void HiCFile::clearCache() {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    zoomDataCache.clear();
+    matrixResolutions.clear();
+    normVectorCache.clear();
+    for (unordered_map<string, expectedValues>::iterator it = expectedValueIndex.begin();
+         it != expectedValueIndex.end(); ++it) {
+        it->second.values.reset();
+    }
+}
+
+// the norm vectors, block index and block numbers shared by getRecords and getSize
+bool HiCFile::prepareQuery(string norm, string chr1loc, string chr2loc, string unit, int binsize, string matrixType,
+                           recordQuery &query, shared_ptr<const matrixZoomData> &zoomData, set<int> &blockNumbers) {
+    if (!valid) {
+        cerr << "File " << fileName << " could not be read" << endl;
+        return false;
+    }
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        cerr << "Usage: straw <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>"
+             << endl;
+        return false;
+    }
+
+    if (!(matrixType == "observed" || matrixType == "oe" || matrixType == "log_oe")) {
+        cerr << "Matrix type " << matrixType << " not understood, must be one of <observed/oe/log_oe>" << endl;
+        return false;
+    }
+
+    long regionIndices[4]; // used to find the blocks we need to access
+    int &c1 = query.c1;
+    int &c2 = query.c2;
+    if (!parseRegion(chr1loc, chr2loc, binsize, c1, c2, query.origRegionIndices, regionIndices)) {
+        return false;
+    }
+    query.binsize = binsize;
+
+    shared_ptr<const vector<double> > &c1Norm = query.c1Norm;
+    shared_ptr<const vector<double> > &c2Norm = query.c2Norm;
+    c1Norm.reset();
+    c2Norm.reset();
+    if (norm != "NONE") {
+        // only the bins of the region are read; intra-chromosomal queries also normalize the
+        // mirrored records, so there both axes come from the one vector
+        long firstBin1 = regionIndices[0], lastBin1 = regionIndices[1];
+        long firstBin2 = regionIndices[2], lastBin2 = regionIndices[3];
+        if (c1 == c2) {
+            firstBin1 = firstBin2 = min(firstBin1, firstBin2);
+            lastBin1 = lastBin2 = max(lastBin1, lastBin2);
+        }
+        c1Norm = getNormVector(norm, c1, unit, binsize, firstBin1, lastBin1);
+        c2Norm = getNormVector(norm, c2, unit, binsize, firstBin2, lastBin2);
+        if (c1Norm == NULL || c2Norm == NULL) {
+            cerr << "File did not contain " << norm << " normalization vectors for one or both chromosomes at "
+                 << binsize << " " << unit << endl;
+            return false;
+        }
+    }
+
+    zoomData = getZoomData(c1, c2, unit, binsize);
+    if (zoomData == NULL) {
+        return false;
+    }
+    query.overExpected = matrixType != "observed";
+    if (query.overExpected && !prepareExpected(matrixType, norm, unit, binsize, *zoomData, query)) {
+        return false;
+    }
+
+    long bins[4]; // bins of the records the query returns
+    getRegionBins(query.origRegionIndices[0], query.origRegionIndices[1], binsize, bins[0], bins[1]);
+    getRegionBins(query.origRegionIndices[2], query.origRegionIndices[3], binsize, bins[2], bins[3]);
+    blockNumbers.clear();
+    query.insideBlocks.clear();
+    getBlocksForRegion(bins, zoomData->blockBinCount, zoomData->blockColumnCount, c1 == c2, version > 8,
+                       blockNumbers, query.insideBlocks);
+    return true;
+}
+
+// appends one contact to the output of a query
+inline void appendRecord(vector<contactRecord> &records, int binX, int binY, float counts) {
+    contactRecord record;
+    record.binX = binX;
+    record.binY = binY;
+    record.counts = counts;
+    records.push_back(record);
+}
+
+inline void appendRecord(contactArrays &records, int binX, int binY, float counts) {
+    records.binX.push_back(binX);
+    records.binY.push_back(binY);
+    records.counts.push_back(counts);
+}
+
+// running statistics of a query's contacts, in place of the contacts themselves
+struct statsRecords {
+    contactStats stats;
+    unordered_set<int> binsX;
+    unordered_set<int> binsY;
+};
+
+inline void appendRecord(statsRecords &records, int binX, int binY, float counts) {
+    records.stats.contacts++;
+    // normalized contacts of bins without a norm value are NaN; they are counted but add nothing
+    if (counts == counts && counts != 0) {
+        records.stats.sum += counts;
+        records.binsX.insert(binX);
+        records.binsY.insert(binY);
+    }
+}
+
+// appends the contacts of a block that fall in the query region, in base pairs (or fragments) and normalized.
+// contacts of blocks entirely inside the region are not checked
+template<class Records>
+void appendMatchingRecords(const vector<contactRecord> &block, const recordQuery &query, bool inside,
+                           Records &records) {
+    const long *origRegionIndices = query.origRegionIndices;
+    for (vector<contactRecord>::const_iterator it2 = block.begin(); it2 != block.end(); ++it2) {
+        contactRecord rec = *it2;
+
+        long x = rec.binX * query.binsize;
+        long y = rec.binY * query.binsize;
+        float c = rec.counts;
+        if (query.c1Norm) {
+            c = c / ((*query.c1Norm)[rec.binX] * (*query.c2Norm)[rec.binY]);
+        }
+        if (query.overExpected) {
+            c = query.expected.apply(rec.binX, rec.binY, c);
+        }
+
+        if (inside ||
+            (x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
+             y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
+            // or check regions that overlap with lower left
+            ((query.c1 == query.c2) && y >= origRegionIndices[0] && y <= origRegionIndices[1] &&
+             x >= origRegionIndices[2] && x <= origRegionIndices[3])) {
+            appendRecord(records, x, y, c);
+            //printf("%d\t%d\t%.14g\n", x, y, c);
+        }
+    }
+}
+
+// appends the matching contacts of the next block; false once all blocks have been read
+template<class Records>
+bool RecordStream::appendNext(Records &records) {
+    if (!reader) return false;
+    int blockNumber;
+    shared_ptr<const vector<contactRecord> > block = reader->next(blockNumber);
+    if (!block) {
+        readFailed = reader->failed();
+        reader.reset();
+        return false;
+    }
+    appendMatchingRecords(*block, query, query.insideBlocks.count(blockNumber) > 0, records);
+    return true;
+}
+
+void clearRecords(vector<contactRecord> &records) {
+    records.clear();
+}
+
+void clearRecords(contactArrays &records) {
+    records.binX.clear();
+    records.binY.clear();
+    records.counts.clear();
+}
+
+bool RecordStream::next(vector<contactRecord> &chunk) {
+    lock_guard<std::mutex> lock(mutex);
+    clearRecords(chunk);
+    while (chunk.empty() && appendNext(chunk));
+    return !chunk.empty();
+}
+
+bool RecordStream::next(contactArrays &chunk) {
+    lock_guard<std::mutex> lock(mutex);
+    clearRecords(chunk);
+    while (chunk.counts.empty() && appendNext(chunk));
+    return !chunk.counts.empty();
+}
+
+// starts a query whose contacts are then read block by block with next(). the stream shares the block
+// index, norm vectors and expected values it needs with the file's caches, so clearCache may be called
+// while it runs; it must not outlive the file
+unique_ptr<RecordStream> HiCFile::openRecordStream(string norm, string chr1loc, string chr2loc, string unit,
+                                                   int binsize, string matrixType) {
+    unique_ptr<RecordStream> stream(new RecordStream());
+    recordQuery &query = stream->query;
+    shared_ptr<const matrixZoomData> zoomData;
+    set<int> blockNumbers;
+    if (!prepareQuery(norm, chr1loc, chr2loc, unit, binsize, matrixType, query, zoomData, blockNumbers)) {
+        return stream;
+    }
+    stream->reader.reset(new BlockReader(*this, query.c1, query.c2, unit, binsize, blockNumbers, zoomData));
+    return stream;
+}
+
+// runs a query, passing the matching contacts of each block to visit as soon as the block is decoded.
+// visit returns false to stop early
+bool HiCFile::visitRecords(string norm, string chr1loc, string chr2loc, string unit, int binsize,
+                           const function<bool(const vector<contactRecord> &)> &visit, string matrixType) {
+    unique_ptr<RecordStream> stream = openRecordStream(norm, chr1loc, chr2loc, unit, binsize, matrixType);
+    if (!stream->reader) return false;
+    vector<contactRecord> chunk;
+    while (stream->next(chunk)) {
+        if (!visit(chunk)) break;
+    }
+    return !stream->failed();
+}
+
+// runs a query, appending the matching contacts to records. false if the query could not be run or
+// blocks could not be read, in which case records may hold some of the contacts
+template<class Records>
+bool HiCFile::fillRecords(string norm, string chr1loc, string chr2loc, string unit, int binsize, string matrixType,
+                          Records &records) {
+    unique_ptr<RecordStream> stream = openRecordStream(norm, chr1loc, chr2loc, unit, binsize, matrixType);
+    if (!stream->reader) return false;
+    while (stream->appendNext(records));
+    return !stream->failed();
+}
+
+// runs many queries at the same bin size, one result per region pair. queries on the same chromosome pair
+// read the union of their blocks once, and each block's contacts are routed to every query that needs it;
+// each result matches what getRecords returns for that region pair
+template<class Records>
+void HiCFile::fillRecordsBatch(string norm, const vector<pair<string, string> > &regions, string unit, int binsize,
+                               string matrixType, vector<Records> &results) {
+    results.assign(regions.size(), Records());
+    vector<recordQuery> queries(regions.size());
+    // (c1, c2) to the queries on that chromosome pair and, for each block they need, which queries need it
+    map<pair<int, int>, map<int, vector<size_t> > > routes;
+    map<pair<int, int>, shared_ptr<const matrixZoomData> > zoomDatas;
+    for (size_t i = 0; i < regions.size(); i++) {
+        recordQuery &query = queries[i];
+        shared_ptr<const matrixZoomData> zoomData;
+        set<int> blockNumbers;
+        if (!prepareQuery(norm, regions[i].first, regions[i].second, unit, binsize, matrixType, query, zoomData,
+                          blockNumbers)) {
+            continue;
+        }
+        pair<int, int> chromosomes(query.c1, query.c2);
+        zoomDatas[chromosomes] = zoomData;
+        map<int, vector<size_t> > &route = routes[chromosomes];
+        for (set<int>::const_iterator it = blockNumbers.begin(); it != blockNumbers.end(); ++it) {
+            route[*it].push_back(i);
+        }
+    }
+
+    for (map<pair<int, int>, map<int, vector<size_t> > >::const_iterator group = routes.begin();
+         group != routes.end(); ++group) {
+        const map<int, vector<size_t> > &route = group->second;
+        set<int> blockNumbers;
+        for (map<int, vector<size_t> >::const_iterator it = route.begin(); it != route.end(); ++it) {
+            blockNumbers.insert(it->first);
+        }
+        BlockReader reader(*this, group->first.first, group->first.second, unit, binsize, blockNumbers,
+                           zoomDatas[group->first]);
+        int blockNumber;
+        shared_ptr<const vector<contactRecord> > block;
+        while ((block = reader.next(blockNumber))) {
+            const vector<size_t> &targets = route.find(blockNumber)->second;
+            for (vector<size_t>::const_iterator it = targets.begin(); it != targets.end(); ++it) {
+                const recordQuery &query = queries[*it];
+                appendMatchingRecords(*block, query, query.insideBlocks.count(blockNumber) > 0, results[*it]);
+            }
+        }
+        // queries on a matrix whose blocks could not all be read return nothing
+        if (reader.failed()) {
+            for (size_t i = 0; i < queries.size(); i++) {
+                if (queries[i].c1 == group->first.first && queries[i].c2 == group->first.second) {
+                    results[i] = Records();
+                }
+            }
+        }
+    }
+}
+
+vector<vector<contactRecord> > HiCFile::getRecordsBatch(string norm, const vector<pair<string, string> > &regions,
+                                                        string unit, int binsize, string matrixType) {
+    vector<vector<contactRecord> > results;
+    fillRecordsBatch(norm, regions, unit, binsize, matrixType, results);
+    return results;
+}
+
+vector<contactArrays> HiCFile::getRecordArraysBatch(string norm, const vector<pair<string, string> > &regions,
+                                                    string unit, int binsize, string matrixType) {
+    vector<contactArrays> results;
+    fillRecordsBatch(norm, regions, unit, binsize, matrixType, results);
+    return results;
+}
+
+// a block of a genome-wide dump: the query of its matrix, and where it is in the file
+struct plannedBlock {
+    size_t query;
+    int blockNumber;
+    indexEntry idx;
+};
+
+// dumps every matrix of the file at one resolution in a single pass, passing the contacts of each block to
+// sink with the indices of its chromosomes (as in getChromosomes). the blocks of all matrices are read in
+// file order, with nearby reads merged, and decoded ahead on the thread pool; each matrix gives the same
+// contacts as getRecords over both whole chromosomes. matrices of the "All" chromosome, and matrices
+// without this resolution or its norm vectors, are skipped. blocks do not go through the block cache,
+// which a genome-wide pass would only flush. sink returns false to stop early
+bool HiCFile::dumpGenome(string norm, string unit, int binsize,
+                         const function<bool(int, int, const vector<contactRecord> &)> &sink, string matrixType) {
+    if (!valid) {
+        cerr << "File " << fileName << " could not be read" << endl;
+        return false;
+    }
+    map<int, string> names;
+    for (map<string, chromosome>::const_iterator it = chromosomeMap.begin(); it != chromosomeMap.end(); ++it) {
+        string name = it->first;
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name != "all") names[it->second.index] = it->first;
+    }
+    set<pair<int, int> > matrices;
+    for (unordered_map<string, indexEntry>::const_iterator it = masterIndex.begin(); it != masterIndex.end(); ++it) {
+        int c1, c2;
+        char sep;
+        stringstream key(it->first);
+        if (key >> c1 >> sep >> c2 && names.count(c1) && names.count(c2)) matrices.insert(make_pair(c1, c2));
+    }
+
+    // every block of every matrix, in file order
+    vector<recordQuery> queries;
+    vector<plannedBlock> plan;
+    for (set<pair<int, int> >::const_iterator it = matrices.begin(); it != matrices.end(); ++it) {
+        shared_ptr<const vector<zoomLevel> > levels = getMatrixResolutions(it->first, it->second);
+        bool found = false;
+        for (size_t i = 0; levels && i < levels->size(); i++) {
+            found = found || ((*levels)[i].unit == unit && (*levels)[i].binSize == binsize);
+        }
+        if (!found) continue;
+        recordQuery query;
+        shared_ptr<const matrixZoomData> zoomData;
+        set<int> blockNumbers;
+        if (!prepareQuery(norm, names[it->first], names[it->second], unit, binsize, matrixType, query, zoomData,
+                          blockNumbers)) {
+            continue;
+        }
+        for (set<int>::const_iterator block = blockNumbers.begin(); block != blockNumbers.end(); ++block) {
+            plannedBlock planned;
+            planned.query = queries.size();
+            planned.blockNumber = *block;
+            if (zoomData->findBlock(*block, planned.idx) && planned.idx.size > 0) plan.push_back(planned);
+        }
+        queries.push_back(query);
+    }
+    sort(plan.begin(), plan.end(), [](const plannedBlock &a, const plannedBlock &b) {
+        return a.idx.position < b.idx.position;
+    });
+
+    struct pendingDecode {
+        size_t block;
+        future<void> done;
+        shared_ptr<vector<contactRecord> > records;
+    };
+    shared_ptr<ThreadPool> pool = getThreadPool();
+    size_t maxPending = pool ? 4 * (size_t) pool->size() : 0;
+    size_t readAhead = max((size_t) 64, maxPending + 1);
+    deque<pair<size_t, shared_ptr<char> > > fetched;
+    deque<pendingDecode> pending;
+    size_t nextRead = 0;
+    bool readFailed = false;
+    vector<contactRecord> chunk;
+    while (true) {
+        while (pending.size() <= maxPending) {
+            if (fetched.empty() && nextRead < plan.size()) {
+                vector<indexEntry> entries;
+                for (size_t i = nextRead; i < plan.size() && entries.size() < readAhead; i++) {
+                    entries.push_back(plan[i].idx);
+                }
+                vector<shared_ptr<char> > bytes;
+                if (!readBlocks(entries, bytes)) {
+                    readFailed = true;
+                    break;
+                }
+                for (size_t i = 0; i < bytes.size(); i++) {
+                    fetched.push_back(make_pair(nextRead + i, bytes[i]));
+                }
+                nextRead += bytes.size();
+            }
+            if (fetched.empty()) break;
+            pendingDecode next;
+            next.block = fetched.front().first;
+            next.records = getRecordPool().acquire();
+            shared_ptr<char> compressedBytes = fetched.front().second;
+            shared_ptr<vector<contactRecord> > records = next.records;
+            long size = plan[next.block].idx.size;
+            int version = this->version;
+            function<void()> decode = [compressedBytes, size, version, records]() {
+                decodeBlock(compressedBytes.get(), size, version, *records);
+            };
+            fetched.pop_front();
+            if (pool) {
+                next.done = pool->submit(decode);
+            } else {
+                decode();
+            }
+            pending.push_back(std::move(next));
+        }
+        if (pending.empty() || readFailed) break;
+
+        if (pending.front().done.valid()) pending.front().done.wait();
+        const plannedBlock &block = plan[pending.front().block];
+        const recordQuery &query = queries[block.query];
+        chunk.clear();
+        appendMatchingRecords(*pending.front().records, query, query.insideBlocks.count(block.blockNumber) > 0,
+                              chunk);
+        pending.pop_front();
+        if (!chunk.empty() && !sink(query.c1, query.c2, chunk)) break;
+    }
+    // blocks still decoding may point into the memory mapping
+    for (deque<pendingDecode>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        if (it->done.valid()) it->done.wait();
+    }
+    return !readFailed;
+}
 
-    indexEntry c1NormEntry, c2NormEntry;
-    long myFilePos;
+// one nonzero cell of a genome-wide matrix, by bin ids counted across all chromosomes
+struct pixelRecord {
+    long bin1;
+    long bin2;
+    float count;
+};
 
-    long bytes_to_read = total_bytes - master;
-    bool foundFooter = false;
-    if (isHttp) {
-        char *buffer2;
-        buffer2 = getData(curl, master, bytes_to_read);
-        membuf sbuf2(buffer2, buffer2 + bytes_to_read);
-        istream bufin2(&sbuf2);
-        foundFooter = readFooter(bufin2, master, c1, c2, norm, unit, binsize, myFilePos, c1NormEntry, c2NormEntry);
-        delete buffer2;
-    } else {
-        fin.seekg(master, ios::beg);
-        foundFooter = readFooter(fin, master, c1, c2, norm, unit, binsize, myFilePos, c1NormEntry, c2NormEntry);
-    }
-    // readFooter will assign the above variables
+inline bool pixelLess(const pixelRecord &a, const pixelRecord &b) {
+    return a.bin1 < b.bin1 || (a.bin1 == b.bin1 && a.bin2 < b.bin2);
+}
 
-    if (!foundFooter) {
-        vector <contactRecord> v;
-        return v;
-    }
+// the bins of an export: the chromosomes in index order, each cut into bins of binsize
+struct exportBins {
+    int binsize;
+    vector<string> names;
+    vector<long> lengths;
+    vector<long> offsets; // first bin of each chromosome, then the number of bins
+};
 
-    vector<double> c1Norm;
-    vector<double> c2Norm;
+// destination of the pixels of an export, which arrive sorted by bin1 and then bin2
+class PixelWriter {
+public:
+    virtual ~PixelWriter() {}
 
-    if (norm != "NONE") {
-        char *buffer3;
-        if (isHttp) {
-            buffer3 = getData(curl, c1NormEntry.position, c1NormEntry.size);
-        } else {
-            buffer3 = new char[c1NormEntry.size];
-            fin.seekg(c1NormEntry.position, ios::beg);
-            fin.read(buffer3, c1NormEntry.size);
+    virtual bool open(const string &path, const exportBins &bins, bool integerCounts) = 0;
+
+    virtual bool write(const vector<pixelRecord> &pixels) = 0;
+
+    // bin1Offsets[i] is the first pixel of bin i, with the number of pixels last
+    virtual bool close(const vector<long> &bin1Offsets) = 0;
+};
+
+// the native columnar layout, all little endian:
+//   "STRAWCOL\0", int format version (1), int bin size, int nChroms, then per chromosome its
+//   null-terminated name and long length; long nBins
+//   chunks of int n, then n long bin1 ids, n long bin2 ids and n float counts
+//   the trailer: long nChunks and the file position of each chunk, nChroms + 1 long chromosome
+//   offsets into the bins, nBins + 1 long bin1 offsets into the pixels, long nnz
+//   and last, long file position of the trailer
+class ColumnWriter : public PixelWriter {
+public:
+    bool open(const string &path, const exportBins &bins, bool integerCounts) override {
+        this->bins = bins;
+        out.open(path.c_str(), ios::binary | ios::trunc);
+        if (!out) return false;
+        const int formatVersion = 1;
+        out.write("STRAWCOL", 9);
+        put(formatVersion);
+        put(bins.binsize);
+        put((int) bins.names.size());
+        for (size_t i = 0; i < bins.names.size(); i++) {
+            out.write(bins.names[i].c_str(), bins.names[i].size() + 1);
+            put(bins.lengths[i]);
         }
-        membuf sbuf3(buffer3, buffer3 + c1NormEntry.size);
-        istream bufferin(&sbuf3);
-        c1Norm = readNormalizationVector(bufferin);
+        put(bins.offsets.back());
+        return (bool) out;
+    }
 
-        char *buffer4;
-        if (isHttp) {
-            buffer4 = getData(curl, c2NormEntry.position, c2NormEntry.size);
-        } else {
-            buffer4 = new char[c2NormEntry.size];
-            fin.seekg(c2NormEntry.position, ios::beg);
-            fin.read(buffer4, c2NormEntry.size);
+    bool write(const vector<pixelRecord> &pixels) override {
+        chunkPositions.push_back(out.tellp());
+        size_t n = pixels.size();
+        put((int) n);
+        vector<long> bins1(n), bins2(n);
+        vector<float> counts(n);
+        for (size_t i = 0; i < n; i++) {
+            bins1[i] = pixels[i].bin1;
+            bins2[i] = pixels[i].bin2;
+            counts[i] = pixels[i].count;
         }
-        membuf sbuf4(buffer4, buffer4 + c2NormEntry.size);
-        istream bufferin2(&sbuf4);
-        c2Norm = readNormalizationVector(bufferin2);
-        delete buffer3;
-        delete buffer4;
+        out.write((const char *) bins1.data(), n * sizeof(long));
+        out.write((const char *) bins2.data(), n * sizeof(long));
+        out.write((const char *) counts.data(), n * sizeof(float));
+        return (bool) out;
     }
 
-    int blockBinCount, blockColumnCount;
-    map<int, indexEntry> blockMap;
+    bool close(const vector<long> &bin1Offsets) override {
+        long trailerPosition = out.tellp();
+        put((long) chunkPositions.size());
+        for (size_t i = 0; i < chunkPositions.size(); i++) put(chunkPositions[i]);
+        for (size_t i = 0; i < bins.offsets.size(); i++) put(bins.offsets[i]);
+        for (size_t i = 0; i < bin1Offsets.size(); i++) put(bin1Offsets[i]);
+        put(bin1Offsets.back());
+        put(trailerPosition);
+        out.close();
+        return (bool) out;
+    }
 
-    if (isHttp) {
-        // readMatrix will assign blockBinCount and blockColumnCount
-        blockMap = readMatrixHttp(curl, myFilePos, unit, binsize, blockBinCount, blockColumnCount);
-    } else {
-        // readMatrix will assign blockBinCount and blockColumnCount
-        blockMap = readMatrix(fin, myFilePos, unit, binsize, blockBinCount, blockColumnCount);
+private:
+    exportBins bins;
+    ofstream out;
+    vector<long> chunkPositions;
+
+    template<class T>
+    void put(T value) {
+        out.write((const char *) &value, sizeof(T));
     }
+};
 
-    set<int> blockNumbers;
-    if (version > 8 && c1 == c2) {
-        blockNumbers = getBlockNumbersForRegionFromBinPositionV9Intra(regionIndices, blockBinCount, blockColumnCount);
-    } else {
-        blockNumbers = getBlockNumbersForRegionFromBinPosition(regionIndices, blockBinCount, blockColumnCount,
-                                                               c1 == c2);
+#ifdef STRAW_USE_HDF5
+// a cooler file (format version 3, fixed bins, upper triangle), written with the HDF5 C library
+class CoolerWriter : public PixelWriter {
+public:
+    CoolerWriter() : file(-1), nnz(0) {
+        for (int i = 0; i < 3; i++) pixels[i] = -1;
     }
 
-    // getBlockIndices
-    vector<contactRecord> records;
-    vector<contactRecord> tmp_records;
-    for (set<int>::iterator it = blockNumbers.begin(); it != blockNumbers.end(); ++it) {
-        // get contacts in this block
-        tmp_records = readBlock(fin, curl, isHttp, blockMap[*it]);
-        for (vector<contactRecord>::iterator it2 = tmp_records.begin(); it2 != tmp_records.end(); ++it2) {
-            contactRecord rec = *it2;
-
-            long x = rec.binX * binsize;
-            long y = rec.binY * binsize;
-            float c = rec.counts;
-            if (norm != "NONE") {
-                c = c / (c1Norm[rec.binX] * c2Norm[rec.binY]);
-            }
+    ~CoolerWriter() override {
+        for (int i = 0; i < 3; i++) {
+            if (pixels[i] >= 0) H5Dclose(pixels[i]);
+        }
+        if (file >= 0) H5Fclose(file);
+    }
 
-            if ((x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
-                 y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
-                // or check regions that overlap with lower left
-                ((c1 == c2) && y >= origRegionIndices[0] && y <= origRegionIndices[1] && x >= origRegionIndices[2] &&
-                 x <= origRegionIndices[3])) {
-                contactRecord record;
-                record.binX = x;
-                record.binY = y;
-                record.counts = c;
-                records.push_back(record);
-                //printf("%d\t%d\t%.14g\n", x, y, c);
+    bool open(const string &path, const exportBins &bins, bool integerCounts) override {
+        this->bins = bins;
+        file = H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+        if (file < 0) return false;
+        long nChroms = (long) bins.names.size();
+        long nBins = bins.offsets.back();
+
+        hid_t group = H5Gcreate2(file, "chroms", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        size_t nameSize = 1;
+        for (size_t i = 0; i < bins.names.size(); i++) nameSize = max(nameSize, bins.names[i].size());
+        vector<char> names(nChroms * nameSize, '\0');
+        for (size_t i = 0; i < bins.names.size(); i++) {
+            memcpy(names.data() + i * nameSize, bins.names[i].data(), bins.names[i].size());
+        }
+        hid_t nameType = H5Tcopy(H5T_C_S1);
+        H5Tset_size(nameType, nameSize);
+        H5Tset_strpad(nameType, H5T_STR_NULLPAD);
+        bool ok = writeColumn(group, "name", nameType, nameType, names.data(), nChroms);
+        H5Tclose(nameType);
+        vector<int> lengths(bins.lengths.begin(), bins.lengths.end());
+        ok = ok && writeColumn(group, "length", H5T_STD_I32LE, H5T_NATIVE_INT, lengths.data(), nChroms);
+        H5Gclose(group);
+
+        // bins/chrom is an enum over the chromosome names, as cooler writes it
+        group = H5Gcreate2(file, "bins", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        hid_t chromType = H5Tenum_create(H5T_NATIVE_INT);
+        for (int i = 0; i < (int) nChroms; i++) H5Tenum_insert(chromType, bins.names[i].c_str(), &i);
+        vector<int> chrom(nBins), start(nBins), end(nBins);
+        for (size_t c = 0; c < bins.names.size(); c++) {
+            for (long b = bins.offsets[c]; b < bins.offsets[c + 1]; b++) {
+                chrom[b] = (int) c;
+                start[b] = (int) ((b - bins.offsets[c]) * bins.binsize);
+                end[b] = (int) min(bins.lengths[c], (long) start[b] + bins.binsize);
             }
         }
+        ok = ok && writeColumn(group, "chrom", chromType, chromType, chrom.data(), nBins);
+        ok = ok && writeColumn(group, "start", H5T_STD_I32LE, H5T_NATIVE_INT, start.data(), nBins);
+        ok = ok && writeColumn(group, "end", H5T_STD_I32LE, H5T_NATIVE_INT, end.data(), nBins);
+        H5Tclose(chromType);
+        H5Gclose(group);
+
+        // pixel columns grow a chunk at a time
+        group = H5Gcreate2(file, "pixels", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        hsize_t dims = 0, maxDims = H5S_UNLIMITED, chunk = 65536;
+        hid_t space = H5Screate_simple(1, &dims, &maxDims);
+        hid_t properties = H5Pcreate(H5P_DATASET_CREATE);
+        H5Pset_chunk(properties, 1, &chunk);
+        if (H5Zfilter_avail(H5Z_FILTER_DEFLATE) > 0) {
+            H5Pset_shuffle(properties);
+            H5Pset_deflate(properties, 6);
+        }
+        countType = integerCounts ? H5T_NATIVE_INT : H5T_NATIVE_DOUBLE;
+        pixels[0] = H5Dcreate2(group, "bin1_id", H5T_STD_I64LE, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+        pixels[1] = H5Dcreate2(group, "bin2_id", H5T_STD_I64LE, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+        pixels[2] = H5Dcreate2(group, "count", integerCounts ? H5T_STD_I32LE : H5T_IEEE_F64LE, space, H5P_DEFAULT,
+                               properties, H5P_DEFAULT);
+        H5Pclose(properties);
+        H5Sclose(space);
+        H5Gclose(group);
+        return ok && pixels[0] >= 0 && pixels[1] >= 0 && pixels[2] >= 0;
     }
-    //      free(chunk.memory);
-    /* always cleanup */
-    // curl_easy_cleanup(curl);
-    //    curl_global_cleanup();
-    return records;
-}
 
+    bool write(const vector<pixelRecord> &chunk) override {
+        size_t n = chunk.size();
+        vector<long> bin1(n), bin2(n);
+        vector<int> intCounts;
+        vector<double> counts;
+        for (size_t i = 0; i < n; i++) {
+            bin1[i] = chunk[i].bin1;
+            bin2[i] = chunk[i].bin2;
+        }
+        if (countType == H5T_NATIVE_INT) {
+            intCounts.resize(n);
+            for (size_t i = 0; i < n; i++) intCounts[i] = (int) lround(chunk[i].count);
+        } else {
+            counts.assign(n, 0);
+            for (size_t i = 0; i < n; i++) counts[i] = chunk[i].count;
+        }
+        bool ok = append(pixels[0], H5T_NATIVE_LONG, bin1.data(), n) &&
+                  append(pixels[1], H5T_NATIVE_LONG, bin2.data(), n) &&
+                  (countType == H5T_NATIVE_INT ? append(pixels[2], countType, intCounts.data(), n)
+                                               : append(pixels[2], countType, counts.data(), n));
+        nnz += n;
+        return ok;
+    }
 
-int getSize(string norm, string fname, string chr1loc, string chr2loc, string unit, int binsize) {
-    if (!(unit == "BP" || unit == "FRAG")) {
-        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
-        cerr << "Usage: straw <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>"
-             << endl;
-        return 0;
+    bool close(const vector<long> &bin1Offsets) override {
+        hid_t group = H5Gcreate2(file, "indexes", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        bool ok = writeColumn(group, "chrom_offset", H5T_STD_I64LE, H5T_NATIVE_LONG, bins.offsets.data(),
+                              bins.offsets.size());
+        ok = ok && writeColumn(group, "bin1_offset", H5T_STD_I64LE, H5T_NATIVE_LONG, bin1Offsets.data(),
+                               bin1Offsets.size());
+        H5Gclose(group);
+
+        time_t now = time(NULL);
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", gmtime(&now));
+        ok = ok && writeAttribute("format", "HDF5::Cooler") && writeAttribute("format-version", 3L) &&
+             writeAttribute("bin-type", "fixed") && writeAttribute("bin-size", (long) bins.binsize) &&
+             writeAttribute("storage-mode", "symmetric-upper") &&
+             writeAttribute("nbins", bins.offsets.back()) && writeAttribute("nchroms", (long) bins.names.size()) &&
+             writeAttribute("nnz", nnz) && writeAttribute("generated-by", "strawC") &&
+             writeAttribute("creation-date", date);
+
+        for (int i = 0; i < 3; i++) {
+            ok = H5Dclose(pixels[i]) >= 0 && ok;
+            pixels[i] = -1;
+        }
+        ok = H5Fclose(file) >= 0 && ok;
+        file = -1;
+        return ok;
     }
 
-    // HTTP code
-    string prefix = "http";
-    bool isHttp = false;
-    ifstream fin;
+private:
+    exportBins bins;
+    hid_t file;
+    hid_t pixels[3];
+    hid_t countType;
+    long nnz;
+
+    static bool writeColumn(hid_t group, const char *name, hid_t fileType, hid_t memoryType, const void *data,
+                            long n) {
+        hsize_t dims = (hsize_t) n;
+        hid_t space = H5Screate_simple(1, &dims, NULL);
+        hid_t dataset = H5Dcreate2(group, name, fileType, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        bool ok = dataset >= 0 && (n == 0 || H5Dwrite(dataset, memoryType, H5S_ALL, H5S_ALL, H5P_DEFAULT, data) >= 0);
+        if (dataset >= 0) H5Dclose(dataset);
+        H5Sclose(space);
+        return ok;
+    }
 
-    // read header into buffer; 100K should be sufficient
-    CURL *curl;
+    static bool append(hid_t dataset, hid_t memoryType, const void *data, size_t n) {
+        hid_t space = H5Dget_space(dataset);
+        hsize_t size;
+        H5Sget_simple_extent_dims(space, &size, NULL);
+        H5Sclose(space);
+        hsize_t newSize = size + n, count = n;
+        if (H5Dset_extent(dataset, &newSize) < 0) return false;
+        space = H5Dget_space(dataset);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, &size, NULL, &count, NULL);
+        hid_t memorySpace = H5Screate_simple(1, &count, NULL);
+        bool ok = H5Dwrite(dataset, memoryType, memorySpace, space, H5P_DEFAULT, data) >= 0;
+        H5Sclose(memorySpace);
+        H5Sclose(space);
+        return ok;
+    }
 
-    long master;
-    map <string, chromosome> chromosomeMap;
-    if (std::strncmp(fname.c_str(), prefix.c_str(), prefix.size()) == 0) {
-        isHttp = true;
-        char *buffer;
-        curl = initCURL(fname.c_str());
-        if (curl) {
-            buffer = getData(curl, 0, 100000);
-        } else {
-            cerr << "URL " << fname << " cannot be opened for reading" << endl;
-            return 0;
+    bool writeAttribute(const char *name, long value) {
+        hid_t space = H5Screate(H5S_SCALAR);
+        hid_t attribute = H5Acreate2(file, name, H5T_STD_I64LE, space, H5P_DEFAULT, H5P_DEFAULT);
+        bool ok = attribute >= 0 && H5Awrite(attribute, H5T_NATIVE_LONG, &value) >= 0;
+        if (attribute >= 0) H5Aclose(attribute);
+        H5Sclose(space);
+        return ok;
+    }
+
+    bool writeAttribute(const char *name, const char *value) {
+        hid_t type = H5Tcopy(H5T_C_S1);
+        H5Tset_size(type, strlen(value) + 1);
+        hid_t space = H5Screate(H5S_SCALAR);
+        hid_t attribute = H5Acreate2(file, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+        bool ok = attribute >= 0 && H5Awrite(attribute, type, value) >= 0;
+        if (attribute >= 0) H5Aclose(attribute);
+        H5Sclose(space);
+        H5Tclose(type);
+        return ok;
+    }
+};
+#endif
+
+// a sorted run of pixels on disk, read back a buffer at a time
+struct pixelRun {
+    ifstream in;
+    vector<pixelRecord> buffer;
+    size_t next;
+
+    bool refill() {
+        buffer.resize(buffer.capacity());
+        in.read((char *) buffer.data(), buffer.size() * sizeof(pixelRecord));
+        buffer.resize(in.gcount() / sizeof(pixelRecord));
+        next = 0;
+        return !buffer.empty();
+    }
+};
+
+// merges sorted run files into one sorted stream of pixels passed to emit, holding about bufferSize
+// pixels in memory across all runs
+bool mergeRunFiles(const vector<string> &runs, size_t bufferSize,
+                   const function<bool(const pixelRecord &)> &emit) {
+    vector<unique_ptr<pixelRun> > inputs;
+    typedef pair<pixelRecord, size_t> head;
+    auto later = [](const head &a, const head &b) { return pixelLess(b.first, a.first); };
+    priority_queue<head, vector<head>, decltype(later)> heads(later);
+    for (size_t i = 0; i < runs.size(); i++) {
+        inputs.push_back(unique_ptr<pixelRun>(new pixelRun()));
+        pixelRun &run = *inputs.back();
+        run.in.open(runs[i].c_str(), ios::binary);
+        if (!run.in) {
+            cerr << "Run file " << runs[i] << " could not be read" << endl;
+            return false;
         }
-        membuf sbuf(buffer, buffer + 100000);
-        istream bufin(&sbuf);
-        chromosomeMap = readHeader(bufin, master);
-        delete buffer;
+        run.buffer.reserve(max((size_t) 1024, bufferSize / runs.size()));
+        if (run.refill()) heads.push(head(run.buffer[run.next++], i));
+    }
+    while (!heads.empty()) {
+        head top = heads.top();
+        heads.pop();
+        if (!emit(top.first)) return false;
+        pixelRun &run = *inputs[top.second];
+        if (run.next < run.buffer.size() || run.refill()) heads.push(head(run.buffer[run.next++], top.second));
+    }
+    return true;
+}
+
+// the most run files merged at once; more are first merged in groups into longer runs
+static const size_t maxMergeRuns = 64;
+
+// exports every chromosome pair at one resolution as a pixel table (bin1_id, bin2_id, count) of the upper
+// triangle of the genome-wide matrix, sorted by bin1_id and bin2_id, with the offset of each bin's first
+// pixel. a path ending in .cool is written as a cooler file, which needs a build with STRAW_USE_HDF5; any
+// other path gets the columnar layout of ColumnWriter. blocks come from dumpGenome in file order, so the
+// pixels are sorted in runs of at most memoryLimit bytes, spilled to files next to path and merged.
+// pixels without a norm value are left out
+bool HiCFile::exportPixels(string norm, string unit, int binsize, string path, long memoryLimit) {
+    if (!valid) {
+        cerr << "File " << fileName << " could not be read" << endl;
+        return false;
+    }
+    if (unit != "BP" || binsize <= 0) {
+        cerr << "Only BP matrices can be exported" << endl;
+        return false;
+    }
+    unique_ptr<PixelWriter> writer;
+    if (path.size() >= 5 && path.compare(path.size() - 5, 5, ".cool") == 0) {
+#ifdef STRAW_USE_HDF5
+        writer.reset(new CoolerWriter());
+#else
+        cerr << "Writing " << path << " needs a build with HDF5 (STRAW_USE_HDF5)" << endl;
+        return false;
+#endif
     } else {
-        fin.open(fname, fstream::in);
-        if (!fin) {
-            cerr << "File " << fname << " cannot be opened for reading" << endl;
-            return 0;
+        writer.reset(new ColumnWriter());
+    }
+
+    // bins of every chromosome but "All", in index order
+    map<int, string> names;
+    for (map<string, chromosome>::const_iterator it = chromosomeMap.begin(); it != chromosomeMap.end(); ++it) {
+        string name = it->first;
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name != "all") names[it->second.index] = it->first;
+    }
+    exportBins bins;
+    bins.binsize = binsize;
+    bins.offsets.push_back(0);
+    map<int, size_t> positions;
+    for (map<int, string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        long length = chromosomeMap[it->second].length;
+        positions[it->first] = bins.names.size();
+        bins.names.push_back(it->second);
+        bins.lengths.push_back(length);
+        bins.offsets.push_back(bins.offsets.back() + (length + binsize - 1) / binsize);
+    }
+    if (!writer->open(path, bins, norm == "NONE")) {
+        cerr << "Pixels could not be written to " << path << endl;
+        return false;
+    }
+
+    size_t runSize = max((size_t) 1024, (size_t) (memoryLimit / (long) sizeof(pixelRecord)));
+    vector<pixelRecord> run;
+    vector<string> runs;
+    int nRunFiles = 0;
+    long outside = 0;
+    bool ok = true;
+    // sorts the pixels held in memory and writes them to a new run file
+    auto spill = [&]() {
+        sort(run.begin(), run.end(), pixelLess);
+        stringstream runPath;
+        runPath << path << ".run" << nRunFiles++;
+        ofstream out(runPath.str().c_str(), ios::binary | ios::trunc);
+        out.write((const char *) run.data(), run.size() * sizeof(pixelRecord));
+        out.close();
+        runs.push_back(runPath.str());
+        run.clear();
+        if (!out) cerr << "Run file " << runPath.str() << " could not be written" << endl;
+        return (bool) out;
+    };
+    ok = dumpGenome(norm, unit, binsize, [&](int c1, int c2, const vector<contactRecord> &records) {
+        size_t position1 = positions[c1], position2 = positions[c2];
+        long firstBin1 = bins.offsets[position1], nBins1 = bins.offsets[position1 + 1] - firstBin1;
+        long firstBin2 = bins.offsets[position2], nBins2 = bins.offsets[position2 + 1] - firstBin2;
+        for (vector<contactRecord>::const_iterator it = records.begin(); it != records.end(); ++it) {
+            if (it->counts != it->counts || it->counts == 0) continue;
+            long bin1 = it->binX / binsize, bin2 = it->binY / binsize;
+            if (bin1 >= nBins1 || bin2 >= nBins2) {
+                outside++;
+                continue;
+            }
+            pixelRecord pixel;
+            pixel.bin1 = firstBin1 + bin1;
+            pixel.bin2 = firstBin2 + bin2;
+            pixel.count = it->counts;
+            run.push_back(pixel);
+            if (run.size() >= runSize && !(ok = spill())) return false;
         }
-        chromosomeMap = readHeader(fin, master);
+        return true;
+    }) && ok;
+    if (outside > 0) {
+        cerr << outside << " contacts past the end of their chromosomes were left out of " << path << endl;
     }
 
-    // parse chromosome positions
-    stringstream ss(chr1loc);
-    string chr1, chr2, x, y;
-    long c1pos1 = -100, c1pos2 = -100, c2pos1 = -100, c2pos2 = -100;
-    getline(ss, chr1, ':');
-    if (chromosomeMap.count(chr1) == 0) {
-        cerr << chr1 << " not found in the file." << endl;
-        return 0;
+    // pixels go to the writer a chunk at a time, counted per bin1 for the offsets
+    const size_t pixelChunk = 256 * 1024;
+    vector<long> bin1Offsets(bins.offsets.back() + 1, 0);
+    vector<pixelRecord> chunk;
+    auto emit = [&](const pixelRecord &pixel) {
+        bin1Offsets[pixel.bin1 + 1]++;
+        chunk.push_back(pixel);
+        if (chunk.size() < pixelChunk) return true;
+        bool written = writer->write(chunk);
+        chunk.clear();
+        return written;
+    };
+    if (ok && runs.empty()) {
+        sort(run.begin(), run.end(), pixelLess);
+        for (size_t i = 0; ok && i < run.size(); i++) ok = emit(run[i]);
+    } else if (ok) {
+        ok = run.empty() || spill();
+        vector<pixelRecord>().swap(run);
+        while (ok && runs.size() > maxMergeRuns) {
+            vector<string> merged;
+            size_t first = 0;
+            for (; ok && first < runs.size(); first += maxMergeRuns) {
+                vector<string> group(runs.begin() + first, runs.begin() + min(runs.size(), first + maxMergeRuns));
+                stringstream runPath;
+                runPath << path << ".run" << nRunFiles++;
+                ofstream out(runPath.str().c_str(), ios::binary | ios::trunc);
+                ok = mergeRunFiles(group, runSize, [&out](const pixelRecord &pixel) {
+                    out.write((const char *) &pixel, sizeof(pixelRecord));
+                    return (bool) out;
+                });
+                out.close();
+                ok = ok && out;
+                for (size_t i = 0; i < group.size(); i++) remove(group[i].c_str());
+                merged.push_back(runPath.str());
+            }
+            for (size_t i = first; i < runs.size(); i++) merged.push_back(runs[i]);
+            runs.swap(merged);
+        }
+        ok = ok && mergeRunFiles(runs, runSize, emit);
     }
+    for (size_t i = 0; i < runs.size(); i++) remove(runs[i].c_str());
+    if (ok && !chunk.empty()) ok = writer->write(chunk);
 
-    if (getline(ss, x, ':') && getline(ss, y, ':')) {
-        c1pos1 = stol(x);
-        c1pos2 = stol(y);
-    } else {
-        c1pos1 = 0;
-        c1pos2 = chromosomeMap[chr1].length;
+    partial_sum(bin1Offsets.begin(), bin1Offsets.end(), bin1Offsets.begin());
+    ok = writer->close(bin1Offsets) && ok;
+    if (!ok) cerr << "Pixels could not be written to " << path << endl;
+    return ok;
+}
+
+vector<contactRecord> HiCFile::getRecords(string norm, string chr1loc, string chr2loc, string unit, int binsize,
+                                          string matrixType) {
+    vector<contactRecord> records;
+    if (!fillRecords(norm, chr1loc, chr2loc, unit, binsize, matrixType, records)) records.clear();
+    return records;
+}
+
+// same contacts as getRecords, as three parallel arrays. they grow as the blocks are decoded, without a
+// separate pass to count the contacts first; spare capacity left by growing is then released so they hold
+// close to 12 bytes per contact
+contactArrays HiCFile::getRecordArrays(string norm, string chr1loc, string chr2loc, string unit, int binsize,
+                                       string matrixType) {
+    contactArrays records;
+    if (!fillRecords(norm, chr1loc, chr2loc, unit, binsize, matrixType, records)) clearRecords(records);
+    if (records.counts.capacity() > records.counts.size() + records.counts.size() / 4) {
+        records.binX.shrink_to_fit();
+        records.binY.shrink_to_fit();
+        records.counts.shrink_to_fit();
     }
-    stringstream ss1(chr2loc);
-    getline(ss1, chr2, ':');
-    if (chromosomeMap.count(chr2) == 0) {
-        cerr << chr2 << " not found in the file." << endl;
-        return 0;
+    return records;
+}
+
+// number of rows (bins of chr1loc) and columns (bins of chr2loc) of the dense matrix of a query
+bool HiCFile::getMatrixShape(string chr1loc, string chr2loc, int binsize, long &nRows, long &nCols) {
+    int c1, c2;
+    long origRegionIndices[4];
+    long regionIndices[4];
+    nRows = 0;
+    nCols = 0;
+    if (!valid || !parseRegion(chr1loc, chr2loc, binsize, c1, c2, origRegionIndices, regionIndices)) {
+        return false;
     }
-    if (getline(ss1, x, ':') && getline(ss1, y, ':')) {
-        c2pos1 = stol(x);
-        c2pos2 = stol(y);
-    } else {
-        c2pos1 = 0;
-        c2pos2 = chromosomeMap[chr2].length;
+    bool swapped = chromosomeMap[chr1loc.substr(0, chr1loc.find(':'))].index != c1;
+    long firstRow, lastRow, firstCol, lastCol;
+    getRegionBins(origRegionIndices[swapped ? 2 : 0], origRegionIndices[swapped ? 3 : 1], binsize, firstRow, lastRow);
+    getRegionBins(origRegionIndices[swapped ? 0 : 2], origRegionIndices[swapped ? 1 : 3], binsize, firstCol, lastCol);
+    nRows = max(0L, lastRow - firstRow + 1);
+    nCols = max(0L, lastCol - firstCol + 1);
+    return true;
+}
+
+// runs a query into a row-major nRows x nCols matrix, whose rows are the bins of chr1loc and columns the bins of
+// chr2loc (see getMatrixShape). cells without contacts are 0; intrachromosomal contacts are mirrored across the
+// diagonal. blocks missing from the block cache are decoded straight into the matrix on the thread pool
+template<class T>
+bool HiCFile::fillDenseMatrix(string norm, string chr1loc, string chr2loc, string unit, int binsize, T *data,
+                              long nRows, long nCols, string matrixType) {
+    long expectedRows, expectedCols;
+    if (!getMatrixShape(chr1loc, chr2loc, binsize, expectedRows, expectedCols)) {
+        return false;
+    }
+    if (nRows != expectedRows || nCols != expectedCols) {
+        cerr << "Matrix for " << chr1loc << " " << chr2loc << " must be " << expectedRows << " x " << expectedCols
+             << ", not " << nRows << " x " << nCols << endl;
+        return false;
     }
 
-    // from header have size of chromosomes, set region to read
-    int c1 = min(chromosomeMap[chr1].index, chromosomeMap[chr2].index);
-    int c2 = max(chromosomeMap[chr1].index, chromosomeMap[chr2].index);
-    long regionIndices[4]; // used to find the blocks we need to access
-    // reverse order if necessary
-    if (chromosomeMap[chr1].index > chromosomeMap[chr2].index) {
-        regionIndices[0] = c2pos1 / binsize;
-        regionIndices[1] = c2pos2 / binsize;
-        regionIndices[2] = c1pos1 / binsize;
-        regionIndices[3] = c1pos2 / binsize;
-    } else {
-        regionIndices[0] = c1pos1 / binsize;
-        regionIndices[1] = c1pos2 / binsize;
-        regionIndices[2] = c2pos1 / binsize;
-        regionIndices[3] = c2pos2 / binsize;
+    recordQuery query;
+    shared_ptr<const matrixZoomData> zoomData;
+    set<int> blockNumbers;
+    if (!prepareQuery(norm, chr1loc, chr2loc, unit, binsize, matrixType, query, zoomData, blockNumbers)) {
+        return false;
+    }
+    int c1 = query.c1, c2 = query.c2;
+    const long *origRegionIndices = query.origRegionIndices;
+
+    denseMatrix<T> matrix;
+    bool swapped = chromosomeMap[chr1loc.substr(0, chr1loc.find(':'))].index != c1;
+    matrix.data = data;
+    matrix.nCols = nCols;
+    getRegionBins(origRegionIndices[swapped ? 2 : 0], origRegionIndices[swapped ? 3 : 1], binsize, matrix.firstRow,
+                  matrix.lastRow);
+    getRegionBins(origRegionIndices[swapped ? 0 : 2], origRegionIndices[swapped ? 1 : 3], binsize, matrix.firstCol,
+                  matrix.lastCol);
+    matrix.xIsRow = !swapped;
+    matrix.intra = c1 == c2;
+    matrix.c1Norm = query.c1Norm.get();
+    matrix.c2Norm = query.c2Norm.get();
+    matrix.overExpected = query.overExpected;
+    matrix.expected = query.expected;
+    fill(data, data + nRows * nCols, (T) 0);
+
+    // blocks cover disjoint cells, so they can be written in any order and from any thread. blocks missing from
+    // the cache are read a batch at a time, so reads of nearby blocks can be merged
+    const size_t readAhead = 64;
+    shared_ptr<ThreadPool> pool = getThreadPool();
+    BlockCache &blockCache = getBlockCache();
+    deque<future<void> > pending;
+    bool ok = true;
+    set<int>::const_iterator it = blockNumbers.begin();
+    while (it != blockNumbers.end()) {
+        vector<indexEntry> entries;
+        for (; it != blockNumbers.end() && entries.size() < readAhead; ++it) {
+            indexEntry idx;
+            if (!zoomData->findBlock(*it, idx) || idx.size == 0) continue;
+            shared_ptr<const vector<contactRecord> > cached = blockCache.get(getBlockKey(c1, c2, unit, binsize, *it));
+            if (cached) {
+                for (vector<contactRecord>::const_iterator rec = cached->begin(); rec != cached->end(); ++rec) {
+                    matrix.set(rec->binX, rec->binY, rec->counts);
+                }
+                continue;
+            }
+            entries.push_back(idx);
+        }
+        vector<shared_ptr<char> > bytes;
+        if (!readBlocks(entries, bytes)) {
+            ok = false;
+            break;
+        }
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            shared_ptr<char> compressedBytes = bytes[i];
+            indexEntry idx = entries[i];
+            int version = this->version;
+            function<void()> decode = [matrix, compressedBytes, idx, version]() {
+                vector<char> &buffer = getInflateBuffer();
+                int uncompressedSize = inflateBlock(compressedBytes.get(), idx.size, buffer);
+                decodeBlockIntoMatrix(buffer.data(), uncompressedSize, version, matrix);
+            };
+            if (!pool) {
+                decode();
+                continue;
+            }
+            pending.push_back(pool->submit(decode));
+            while (pending.size() > 4 * (size_t) pool->size()) {
+                pending.front().wait();
+                pending.pop_front();
+            }
+        }
     }
+    while (!pending.empty()) {
+        pending.front().wait();
+        pending.pop_front();
+    }
+    return ok;
+}
 
-    indexEntry c1NormEntry, c2NormEntry;
-    long myFilePos;
+template bool HiCFile::fillDenseMatrix<float>(string, string, string, string, int, float *, long, long, string);
 
-    long bytes_to_read = total_bytes - master;
-    bool foundFooter = false;
+template bool HiCFile::fillDenseMatrix<double>(string, string, string, string, int, double *, long, long, string);
 
-    if (isHttp) {
-        char *buffer2;
-        buffer2 = getData(curl, master, bytes_to_read);
-        membuf sbuf2(buffer2, buffer2 + bytes_to_read);
-        istream bufin2(&sbuf2);
-        foundFooter = readFooter(bufin2, master, c1, c2, norm, unit, binsize, myFilePos, c1NormEntry, c2NormEntry);
-        delete buffer2;
-    } else {
-        fin.seekg(master, ios::beg);
-        foundFooter = readFooter(fin, master, c1, c2, norm, unit, binsize, myFilePos, c1NormEntry, c2NormEntry);
+// dense matrix of a query, allocated here; see fillDenseMatrix
+vector<float> HiCFile::getDenseMatrix(string norm, string chr1loc, string chr2loc, string unit, int binsize,
+                                      long &nRows, long &nCols, string matrixType) {
+    vector<float> matrix;
+    if (!getMatrixShape(chr1loc, chr2loc, binsize, nRows, nCols)) {
+        return matrix;
     }
-    // readFooter will assign the above variables
+    matrix.resize(nRows * nCols);
+    if (!fillDenseMatrix(norm, chr1loc, chr2loc, unit, binsize, matrix.data(), nRows, nCols, matrixType)) {
+        nRows = 0;
+        nCols = 0;
+        matrix.clear();
+    }
+    return matrix;
+}
 
-    if (!foundFooter) return 0;
+// exact statistics of the contacts getRecords returns for the same query. the blocks are decoded as for
+// getRecords, but the contacts are only counted, never stored
+contactStats HiCFile::getStats(string norm, string chr1loc, string chr2loc, string unit, int binsize,
+                               string matrixType) {
+    statsRecords records;
+    records.stats.contacts = 0;
+    records.stats.sum = 0;
+    if (!fillRecords(norm, chr1loc, chr2loc, unit, binsize, matrixType, records)) {
+        records.stats.contacts = 0;
+        records.stats.sum = 0;
+        records.binsX.clear();
+        records.binsY.clear();
+    }
+    records.stats.nonzeroBinsX = (long) records.binsX.size();
+    records.stats.nonzeroBinsY = (long) records.binsY.size();
+    return records.stats;
+}
 
-    vector<double> c1Norm;
-    vector<double> c2Norm;
+// total number of records of the given blocks. counts come from the block summaries when they cover the
+// resolution; otherwise only the record count at the start of each block is decompressed
+long HiCFile::countBlockRecords(int c1, int c2, string unit, int binsize, const set<int> &blockNumbers,
+                                const matrixZoomData *zoomData) {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    stringstream zoomKey;
+    zoomKey << c1 << "_" << c2 << "_" << unit << "_" << binsize;
+    map<string, map<int, int> >::const_iterator summary = blockSummaries.find(zoomKey.str());
+    if (summary != blockSummaries.end()) {
+        long count = 0;
+        for (set<int>::const_iterator it = blockNumbers.begin(); it != blockNumbers.end(); ++it) {
+            map<int, int>::const_iterator block = summary->second.find(*it);
+            if (block != summary->second.end()) count += block->second;
+        }
+        return count;
+    }
 
-    if (norm != "NONE") {
-        char *buffer3;
-        if (isHttp) {
-            buffer3 = getData(curl, c1NormEntry.position, c1NormEntry.size);
-        } else {
-            buffer3 = new char[c1NormEntry.size];
-            fin.seekg(c1NormEntry.position, ios::beg);
-            fin.read(buffer3, c1NormEntry.size);
+    vector<indexEntry> entries;
+    for (set<int>::const_iterator it = blockNumbers.begin(); it != blockNumbers.end(); ++it) {
+        indexEntry idx;
+        if (zoomData->findBlock(*it, idx)) entries.push_back(idx);
+    }
+    long count = 0;
+    // a batch at a time, so reads of nearby blocks can be merged
+    const size_t readAhead = 64;
+    for (size_t first = 0; first < entries.size(); first += readAhead) {
+        vector<indexEntry> batch(entries.begin() + first, entries.begin() + min(entries.size(), first + readAhead));
+        vector<shared_ptr<char> > bytes;
+        if (!readBlocks(batch, bytes)) return -1;
+        for (size_t i = 0; i < batch.size(); i++) {
+            count += decodeSize(bytes[i].get(), batch[i].size);
         }
-        membuf sbuf3(buffer3, buffer3 + c1NormEntry.size);
-        istream bufferin(&sbuf3);
-        c1Norm = readNormalizationVector(bufferin);
+    }
+    return count;
+}
 
-        char *buffer4;
-        if (isHttp) {
-            buffer4 = getData(curl, c2NormEntry.position, c2NormEntry.size);
-        } else {
-            buffer4 = new char[c2NormEntry.size];
-            fin.seekg(c2NormEntry.position, ios::beg);
-            fin.read(buffer4, c2NormEntry.size);
+// upper bound on the number of contacts getRecords returns: the records of every block the query reads,
+// but no more than the cells of the region. without block summaries (see readBlockSummaries) each of those
+// blocks is read and the start of it inflated to get its record count, which for a large query costs
+// about as much I/O as the query itself; with them, only the summaries are looked up
+long HiCFile::getSize(string norm, string chr1loc, string chr2loc, string unit, int binsize) {
+    recordQuery query;
+    shared_ptr<const matrixZoomData> zoomData;
+    set<int> blockNumbers;
+    if (!prepareQuery(norm, chr1loc, chr2loc, unit, binsize, "observed", query, zoomData, blockNumbers)) {
+        return 0;
+    }
+    long count = countBlockRecords(query.c1, query.c2, unit, binsize, blockNumbers, zoomData.get());
+    if (count < 0) return 0;
+
+    // intra-chromosomal contacts are stored once, so even with the mirrored region each cell of the
+    // region holds at most one of them
+    long bins[4];
+    getRegionBins(query.origRegionIndices[0], query.origRegionIndices[1], binsize, bins[0], bins[1]);
+    getRegionBins(query.origRegionIndices[2], query.origRegionIndices[3], binsize, bins[2], bins[3]);
+    long cells = max(0L, bins[1] - bins[0] + 1) * max(0L, bins[3] - bins[2] + 1);
+    return min(count, cells);
+}
+
+// counts the records of every block of every matrix at one resolution and keeps them as block summaries,
+// then writes all the summaries held so far to path, so later getSize calls (here, or in another process
+// after readBlockSummaries) need no block reads at all
+bool HiCFile::writeBlockSummaries(string path, string unit, int binsize) {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    if (!valid) {
+        cerr << "File " << fileName << " could not be read" << endl;
+        return false;
+    }
+    for (unordered_map<string, indexEntry>::const_iterator it = masterIndex.begin(); it != masterIndex.end(); ++it) {
+        int c1, c2;
+        char sep;
+        stringstream key(it->first);
+        if (!(key >> c1 >> sep >> c2)) continue;
+        stringstream zoomKey;
+        zoomKey << c1 << "_" << c2 << "_" << unit << "_" << binsize;
+        if (blockSummaries.count(zoomKey.str())) continue;
+        shared_ptr<const matrixZoomData> zoomData = getZoomData(c1, c2, unit, binsize);
+        if (zoomData == NULL) continue;
+
+        map<int, int> counts;
+        const size_t readAhead = 64;
+        for (size_t first = 0; first < zoomData->blockEntries.size(); first += readAhead) {
+            size_t last = min(zoomData->blockEntries.size(), first + readAhead);
+            vector<indexEntry> batch(zoomData->blockEntries.begin() + first, zoomData->blockEntries.begin() + last);
+            vector<shared_ptr<char> > bytes;
+            if (!readBlocks(batch, bytes)) return false;
+            for (size_t i = 0; i < batch.size(); i++) {
+                counts[zoomData->blockNumbers[first + i]] = decodeSize(bytes[i].get(), batch[i].size);
+            }
         }
-        membuf sbuf4(buffer4, buffer4 + c2NormEntry.size);
-        istream bufferin2(&sbuf4);
-        c2Norm = readNormalizationVector(bufferin2);
-        delete buffer3;
-        delete buffer4;
+        blockSummaries[zoomKey.str()].swap(counts);
     }
 
-    int blockBinCount, blockColumnCount;
-    map<int, indexEntry> blockMap;
-    if (isHttp) {
-        // readMatrix will assign blockBinCount and blockColumnCount
-        blockMap = readMatrixHttp(curl, myFilePos, unit, binsize, blockBinCount, blockColumnCount);
-    } else {
-        // readMatrix will assign blockBinCount and blockColumnCount
-        blockMap = readMatrix(fin, myFilePos, unit, binsize, blockBinCount, blockColumnCount);
+    ofstream fout(path.c_str(), ios::binary | ios::trunc);
+    if (!fout) {
+        cerr << "Block summaries could not be written to " << path << endl;
+        return false;
     }
-    set<int> blockNumbers;
-    if (version > 8 && c1 == c2) {
-        blockNumbers = getBlockNumbersForRegionFromBinPositionV9Intra(regionIndices, blockBinCount, blockColumnCount);
-    } else {
-        blockNumbers = getBlockNumbersForRegionFromBinPosition(regionIndices, blockBinCount, blockColumnCount,
-                                                               c1 == c2);
+    // the file's master index position and size identify the .hic file the summaries belong to
+    const int summaryVersion = 1;
+    fout.write("STRAWBLK", 9);
+    fout.write((const char *) &summaryVersion, sizeof(int));
+    fout.write((const char *) &master, sizeof(long));
+    fout.write((const char *) &totalBytes, sizeof(long));
+    int nGroups = (int) blockSummaries.size();
+    fout.write((const char *) &nGroups, sizeof(int));
+    for (map<string, map<int, int> >::const_iterator it = blockSummaries.begin(); it != blockSummaries.end(); ++it) {
+        fout.write(it->first.c_str(), it->first.size() + 1);
+        int nBlocks = (int) it->second.size();
+        fout.write((const char *) &nBlocks, sizeof(int));
+        for (map<int, int>::const_iterator block = it->second.begin(); block != it->second.end(); ++block) {
+            fout.write((const char *) &block->first, sizeof(int));
+            fout.write((const char *) &block->second, sizeof(int));
+        }
+    }
+    fout.close();
+    if (!fout) {
+        cerr << "Block summaries could not be written to " << path << endl;
+        return false;
     }
+    return true;
+}
 
-    // getBlockIndices
-    vector<contactRecord> tmp_records;
-    int count = 0;
-    for (set<int>::iterator it = blockNumbers.begin(); it != blockNumbers.end(); ++it) {
-        // get contacts in this block
-        count += readSize(fin, curl, isHttp, blockMap[*it]);
+// loads block summaries written by writeBlockSummaries for this file. summaries of another file, or of
+// another version of this one, are rejected
+bool HiCFile::readBlockSummaries(string path) {
+    lock_guard<recursive_mutex> lock(fileMutex);
+    ifstream sin(path.c_str(), ios::binary);
+    string magic;
+    getline(sin, magic, '\0');
+    if (!sin || magic != "STRAWBLK") {
+        cerr << path << " is not a block summary file" << endl;
+        return false;
     }
-    return count;
+    int summaryVersion = readIntFromFile(sin);
+    long summaryMaster = readLongFromFile(sin);
+    long summaryBytes = readLongFromFile(sin);
+    if (!sin || summaryVersion != 1 || summaryMaster != master || summaryBytes != totalBytes) {
+        cerr << "Block summaries in " << path << " do not belong to " << fileName << endl;
+        return false;
+    }
+    map<string, map<int, int> > summaries;
+    int nGroups = readIntFromFile(sin);
+    for (int i = 0; sin && i < nGroups; i++) {
+        string key;
+        getline(sin, key, '\0');
+        int nBlocks = readIntFromFile(sin);
+        map<int, int> &counts = summaries[key];
+        for (int j = 0; sin && j < nBlocks; j++) {
+            int blockNumber = readIntFromFile(sin);
+            counts[blockNumber] = readIntFromFile(sin);
+        }
+    }
+    if (!sin) {
+        cerr << "Block summaries in " << path << " are truncated" << endl;
+        return false;
+    }
+    for (map<string, map<int, int> >::iterator it = summaries.begin(); it != summaries.end(); ++it) {
+        blockSummaries[it->first].swap(it->second);
+    }
+    return true;
+}
+
+vector<contactRecord> straw(string norm, string fname, string chr1loc, string chr2loc, string unit, int binsize,
+                            string matrixType) {
+    HiCFile hiCFile(fname);
+    return hiCFile.getRecords(norm, chr1loc, chr2loc, unit, binsize, matrixType);
+}
+
+contactArrays strawArrays(string norm, string fname, string chr1loc, string chr2loc, string unit, int binsize,
+                          string matrixType) {
+    HiCFile hiCFile(fname);
+    return hiCFile.getRecordArrays(norm, chr1loc, chr2loc, unit, binsize, matrixType);
+}
+
+vector<vector<contactRecord> > strawBatch(string norm, string fname, const vector<pair<string, string> > &regions,
+                                          string unit, int binsize, string matrixType) {
+    HiCFile hiCFile(fname);
+    return hiCFile.getRecordsBatch(norm, regions, unit, binsize, matrixType);
+}
+
+long getSize(string norm, string fname, string chr1loc, string chr2loc, string unit, int binsize) {
+    HiCFile hiCFile(fname);
+    return hiCFile.getSize(norm, chr1loc, chr2loc, unit, binsize);
+}
+
+bool dumpGenome(string norm, string fname, string unit, int binsize,
+                const function<bool(int, int, const vector<contactRecord> &)> &sink, string matrixType) {
+    HiCFile hiCFile(fname);
+    return hiCFile.dumpGenome(norm, unit, binsize, sink, matrixType);
+}
+
+bool exportPixels(string norm, string fname, string unit, int binsize, string path, long memoryLimit) {
+    HiCFile hiCFile(fname);
+    return hiCFile.exportPixels(norm, unit, binsize, path, memoryLimit);
+}
+
+contactStats getStats(string norm, string fname, string chr1loc, string chr2loc, string unit, int binsize,
+                      string matrixType) {
+    HiCFile hiCFile(fname);
+    return hiCFile.getStats(norm, chr1loc, chr2loc, unit, binsize, matrixType);
 }
 
 
 namespace py = pybind11;
 
+// hands a vector to NumPy without copying: the array views the vector's buffer and a
+// capsule owning the vector frees it when the array is collected
+template<class T>
+py::array_t<T> toNumpy(std::vector<T> &values) {
+    std::vector<T> *owned = new std::vector<T>();
+    owned->swap(values);
+    py::capsule owner(owned, [](void *p) { delete reinterpret_cast<std::vector<T> *>(p); });
+    return py::array_t<T>(owned->size(), owned->data(), owner);
+}
+
+// same as toNumpy, viewing the vector as a row-major nRows x nCols matrix
+py::array_t<float> matrixToNumpy(std::vector<float> &values, long nRows, long nCols) {
+    std::vector<float> *owned = new std::vector<float>();
+    owned->swap(values);
+    py::capsule owner(owned, [](void *p) { delete reinterpret_cast<std::vector<float> *>(p); });
+    return py::array_t<float>({nRows, nCols}, owned->data(), owner);
+}
+
+py::tuple arraysToNumpy(contactArrays records) {
+    return py::make_tuple(toNumpy(records.binX), toNumpy(records.binY), toNumpy(records.counts));
+}
+
 PYBIND11_MODULE(strawC, m) {
   m.doc() = R"pbdoc(
         New straw with pybind
@@ -1242,13 +3845,292 @@ Example:
 See https://github.com/theaidenlab/straw/wiki/Python for more documentation
     )pbdoc";
 
-  m.def("strawC", &straw, R"pbdoc(
+  m.def("strawC", &straw, py::arg("norm"), py::arg("fname"), py::arg("chr1loc"), py::arg("chr2loc"),
+        py::arg("unit"), py::arg("binsize"), py::arg("matrixType") = "observed",
+        py::call_guard<py::gil_scoped_release>(), R"pbdoc(
         Straw: fast C++ implementation of dump.
 
         Bound with pybind
-Usage: straw <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>
+Usage: straw <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize> [observed/oe/log_oe]
+matrixType "oe" divides each count by its expected value from the file's footer; "log_oe" is its natural log.
+    )pbdoc");
+
+  m.def("strawBatch", &strawBatch, py::arg("norm"), py::arg("fname"), py::arg("regions"), py::arg("unit"),
+        py::arg("binsize"), py::arg("matrixType") = "observed", py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Runs many queries against one file, norm, unit and bin size. regions is a list of (chr1loc, chr2loc)
+        pairs; returns one list of contactRecord per pair. Blocks shared by several regions are read once.
+    )pbdoc");
+
+  PYBIND11_NUMPY_DTYPE(contactRecord, binX, binY, counts);
+
+  m.def("strawAsArrays", [](std::string norm, std::string fname, std::string chr1loc, std::string chr2loc,
+                            std::string unit, int binsize, std::string matrixType) {
+      contactArrays records;
+      {
+          py::gil_scoped_release release;
+          records = strawArrays(norm, fname, chr1loc, chr2loc, unit, binsize, matrixType);
+      }
+      return arraysToNumpy(std::move(records));
+  }, py::arg("norm"), py::arg("fname"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"),
+     py::arg("matrixType") = "observed", R"pbdoc(
+        Same as strawC, but returns a tuple of three NumPy arrays (binX, binY, counts)
+        that share memory with the C++ result instead of a list of contactRecord.
+    )pbdoc");
+
+  py::class_<HiCFile>(m, "HiCFile", R"pbdoc(
+        Opens a .hic file or URL once; the header, master index and normalization vector
+        index are read on construction and reused by every query. Queries release the GIL,
+        so several threads can query one file at once.
+Example:
+>>>hic = strawC.HiCFile('HIC001.hic')
+>>>result = hic.getRecords('NONE', 'X', 'X', 'BP', 1000000)
+    )pbdoc")
+    .def(py::init<std::string>(), py::call_guard<py::gil_scoped_release>())
+    .def("isValid", &HiCFile::isValid)
+    .def("getVersion", &HiCFile::getVersion)
+    .def("getChromosomes", &HiCFile::getChromosomes)
+    .def("getRecords", &HiCFile::getRecords, py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"),
+         py::arg("unit"), py::arg("binsize"), py::arg("matrixType") = "observed",
+         py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Returns the contacts as a list of contactRecord. matrixType is "observed", "oe" (observed/expected,
+        with the expected values of norm from the file's footer) or "log_oe" (its natural log).
+    )pbdoc")
+    .def("getRecordsAsArrays", [](HiCFile &hiCFile, std::string norm, std::string chr1loc, std::string chr2loc,
+                                  std::string unit, int binsize, std::string matrixType) {
+        contactArrays records;
+        {
+            py::gil_scoped_release release;
+            records = hiCFile.getRecordArrays(norm, chr1loc, chr2loc, unit, binsize, matrixType);
+        }
+        return arraysToNumpy(std::move(records));
+    }, py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"),
+       py::arg("matrixType") = "observed", R"pbdoc(
+        Returns the contacts as a tuple of three NumPy arrays (binX, binY, counts), without copying.
+    )pbdoc")
+    .def("iterRecords", [](HiCFile &hiCFile, std::string norm, std::string chr1loc, std::string chr2loc,
+                           std::string unit, int binsize, std::string matrixType) {
+        return hiCFile.openRecordStream(norm, chr1loc, chr2loc, unit, binsize, matrixType);
+    }, py::keep_alive<0, 1>(), py::call_guard<py::gil_scoped_release>(),
+       py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"),
+       py::arg("binsize"), py::arg("matrixType") = "observed", R"pbdoc(
+        Returns an iterator over the contacts, one chunk per block, each a tuple of three NumPy arrays
+        (binX, binY, counts). Only a few blocks are held in memory at a time, so the first chunk is
+        available before the query is done. clearCache may be called while iterating.
+    )pbdoc")
+    .def("getRecordsBatch", &HiCFile::getRecordsBatch, py::arg("norm"), py::arg("regions"), py::arg("unit"),
+         py::arg("binsize"), py::arg("matrixType") = "observed", py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Runs the query for each (chr1loc, chr2loc) pair in regions, reading blocks shared by several
+        regions once; returns one list of contactRecord per pair.
+    )pbdoc")
+    .def("getRecordsBatchAsArrays", [](HiCFile &hiCFile, std::string norm,
+                                       const std::vector<std::pair<std::string, std::string> > &regions,
+                                       std::string unit, int binsize, std::string matrixType) {
+        std::vector<contactArrays> results;
+        {
+            py::gil_scoped_release release;
+            results = hiCFile.getRecordArraysBatch(norm, regions, unit, binsize, matrixType);
+        }
+        py::list arrays;
+        for (size_t i = 0; i < results.size(); i++) {
+            arrays.append(arraysToNumpy(std::move(results[i])));
+        }
+        return arrays;
+    }, py::arg("norm"), py::arg("regions"), py::arg("unit"), py::arg("binsize"), py::arg("matrixType") = "observed",
+       R"pbdoc(
+        Same as getRecordsBatch, with each result a tuple of three NumPy arrays (binX, binY, counts).
+    )pbdoc")
+    .def("getRecordsAsStructuredArray", [](HiCFile &hiCFile, std::string norm, std::string chr1loc,
+                                           std::string chr2loc, std::string unit, int binsize,
+                                           std::string matrixType) {
+        std::vector<contactRecord> records;
+        {
+            py::gil_scoped_release release;
+            records = hiCFile.getRecords(norm, chr1loc, chr2loc, unit, binsize, matrixType);
+        }
+        return toNumpy(records);
+    }, py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"),
+       py::arg("matrixType") = "observed", R"pbdoc(
+        Returns the contacts as one NumPy structured array with fields binX, binY and counts, without copying.
+    )pbdoc")
+    .def("getDenseMatrix", [](HiCFile &hiCFile, std::string norm, std::string chr1loc, std::string chr2loc,
+                              std::string unit, int binsize, std::string matrixType) {
+        long nRows, nCols;
+        std::vector<float> matrix;
+        {
+            py::gil_scoped_release release;
+            matrix = hiCFile.getDenseMatrix(norm, chr1loc, chr2loc, unit, binsize, nRows, nCols, matrixType);
+        }
+        return matrixToNumpy(matrix, nRows, nCols);
+    }, py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"),
+       py::arg("matrixType") = "observed", R"pbdoc(
+        Returns the query as a 2D float32 NumPy array; rows are bins of chr1loc, columns bins of chr2loc,
+        and intrachromosomal contacts are mirrored across the diagonal. Cells without contacts are 0,
+        whatever the matrixType.
+    )pbdoc")
+    .def("fillDenseMatrix", [](HiCFile &hiCFile, std::string norm, std::string chr1loc, std::string chr2loc,
+                               std::string unit, int binsize, py::array_t<float, py::array::c_style> out,
+                               std::string matrixType) {
+        float *data = out.mutable_data();
+        long nRows = out.shape(0), nCols = out.shape(1);
+        py::gil_scoped_release release;
+        return hiCFile.fillDenseMatrix(norm, chr1loc, chr2loc, unit, binsize, data, nRows, nCols, matrixType);
+    }, py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"),
+       py::arg("out").noconvert(), py::arg("matrixType") = "observed")
+    .def("fillDenseMatrix", [](HiCFile &hiCFile, std::string norm, std::string chr1loc, std::string chr2loc,
+                               std::string unit, int binsize, py::array_t<double, py::array::c_style> out,
+                               std::string matrixType) {
+        double *data = out.mutable_data();
+        long nRows = out.shape(0), nCols = out.shape(1);
+        py::gil_scoped_release release;
+        return hiCFile.fillDenseMatrix(norm, chr1loc, chr2loc, unit, binsize, data, nRows, nCols, matrixType);
+    }, py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"),
+       py::arg("out").noconvert(), py::arg("matrixType") = "observed", R"pbdoc(
+        Fills a preallocated C-contiguous 2D float32 or float64 array with the query, shaped
+        as returned by getMatrixShape.
+    )pbdoc")
+    .def("getMatrixShape", [](HiCFile &hiCFile, std::string chr1loc, std::string chr2loc, int binsize) {
+        long nRows, nCols;
+        hiCFile.getMatrixShape(chr1loc, chr2loc, binsize, nRows, nCols);
+        return py::make_tuple(nRows, nCols);
+    })
+    .def("dumpGenome", [](HiCFile &hiCFile, std::string norm, std::string unit, int binsize, py::function sink,
+                          std::string matrixType) {
+        py::gil_scoped_release release;
+        return hiCFile.dumpGenome(norm, unit, binsize,
+                                  [&sink](int chr1, int chr2, const std::vector<contactRecord> &records) {
+            contactArrays arrays;
+            for (size_t i = 0; i < records.size(); i++) {
+                appendRecord(arrays, records[i].binX, records[i].binY, records[i].counts);
+            }
+            py::gil_scoped_acquire acquire;
+            py::object result = sink(chr1, chr2, arraysToNumpy(std::move(arrays)));
+            return result.is_none() || result.cast<bool>();
+        }, matrixType);
+    }, py::arg("norm"), py::arg("unit"), py::arg("binsize"), py::arg("sink"), py::arg("matrixType") = "observed",
+    R"pbdoc(
+        Dumps every chromosome pair at one resolution in a single pass over the file, calling
+        sink(chr1, chr2, (binX, binY, counts)) for each block's contacts, with the chromosome indices
+        of getChromosomes. Returning False from sink stops the dump.
+    )pbdoc")
+    .def("exportPixels", &HiCFile::exportPixels, py::arg("norm"), py::arg("unit"), py::arg("binsize"),
+         py::arg("path"), py::arg("memoryLimit") = 256L * 1024 * 1024,
+         py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Writes every chromosome pair at one resolution as a sorted pixel table (bin1_id, bin2_id, count)
+        with a bin1 offset index: a cooler file if path ends in .cool (HDF5 builds only), otherwise the
+        native columnar layout. Sorting spills runs of up to memoryLimit bytes next to path.
+    )pbdoc")
+    .def("getResolutions", &HiCFile::getResolutions, py::arg("chr1"), py::arg("chr2"), py::arg("unit") = "BP",
+         py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Returns the bin sizes of a matrix in the given unit, finest first.
+    )pbdoc")
+    .def("pickResolution", &HiCFile::pickResolution, py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"),
+         py::arg("maxPixels"), py::arg("maxContacts") = 0, py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Returns the finest bin size at which the query fits in maxPixels cells and, if given,
+        maxContacts contacts; the coarsest bin size if none does.
+    )pbdoc")
+    .def("getAggregatedRecords", &HiCFile::getAggregatedRecords, py::arg("norm"), py::arg("chr1loc"),
+         py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"), py::arg("matrixType") = "observed",
+         py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Returns the contacts of a query summed into bins of any multiple of a resolution in the file.
+        Only observed contacts can be summed; bins cut by the region edges hold the part inside it.
+    )pbdoc")
+    .def("getStats", &HiCFile::getStats, py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"),
+         py::arg("binsize"), py::arg("matrixType") = "observed", py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Returns the number, sum and distinct positions per axis of the contacts getRecords returns,
+        without building the records.
+    )pbdoc")
+    .def("getSize", &HiCFile::getSize, py::arg("norm"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"),
+         py::arg("binsize"), py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Returns an upper bound on the number of contacts of a query. Unless block summaries have
+        been loaded with readBlockSummaries, this reads every block of the query (over HTTP too)
+        and inflates the start of each to count its records; with them, no blocks are read.
+    )pbdoc")
+    .def("writeBlockSummaries", &HiCFile::writeBlockSummaries, py::arg("path"), py::arg("unit"), py::arg("binsize"),
+         py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Counts the contacts of every block at one resolution and writes them, with any summaries
+        already held, to a sidecar file that makes getSize free of block reads.
+    )pbdoc")
+    .def("readBlockSummaries", &HiCFile::readBlockSummaries, py::arg("path"),
+         py::call_guard<py::gil_scoped_release>(), R"pbdoc(
+        Loads a sidecar file written by writeBlockSummaries for this file.
+    )pbdoc")
+    .def("clearCache", &HiCFile::clearCache, py::call_guard<py::gil_scoped_release>())
+    ;
+
+  m.def("setBlockCacheCapacity", &setBlockCacheCapacity, R"pbdoc(
+        Sets the memory budget in bytes of the decoded block cache shared by all files; 0 disables it.
+    )pbdoc");
+
+  m.def("clearBlockCache", &clearBlockCache);
+
+  m.def("getBlockCacheStats", &getBlockCacheStats, R"pbdoc(
+        Returns the hits, misses, evictions, entries, bytes and capacity of the decoded block cache.
+    )pbdoc");
+
+  m.def("setNumThreads", &setNumThreads, R"pbdoc(
+        Sets the number of threads used to decode blocks; 1 decodes on the calling thread.
+    )pbdoc");
+
+  m.def("getNumThreads", &getNumThreads);
+
+  m.def("setMaxReadGap", &setMaxReadGap, R"pbdoc(
+        Sets how many bytes apart blocks may be and still be fetched with one read (or HTTP range request);
+        negative reads every block separately.
+    )pbdoc");
+
+  m.def("getMaxReadGap", &getMaxReadGap);
+
+  m.def("setMaxHttpRequests", &setMaxHttpRequests, R"pbdoc(
+        Sets how many HTTP range requests a remote file keeps in flight at once.
+    )pbdoc");
+
+  m.def("getMaxHttpRequests", &getMaxHttpRequests);
+
+  m.def("setHttpCacheDirectory", &setHttpCacheDirectory, R"pbdoc(
+        Keeps up to capacity bytes of data fetched from URLs in the given directory, reused by later runs
+        as long as the server reports the same ETag or Last-Modified. An empty directory turns it off.
     )pbdoc");
 
+  py::class_<RecordStream, std::unique_ptr<RecordStream> >(m, "RecordStream")
+    .def("__iter__", [](RecordStream &stream) -> RecordStream & { return stream; })
+    .def("__next__", [](RecordStream &stream) {
+        contactArrays chunk;
+        bool more;
+        {
+            py::gil_scoped_release release;
+            more = stream.next(chunk);
+        }
+        if (!more) {
+            if (stream.failed()) throw std::runtime_error("blocks of the query could not be read");
+            throw py::stop_iteration();
+        }
+        return arraysToNumpy(std::move(chunk));
+    })
+    ;
+
+  py::class_<blockCacheStats>(m, "blockCacheStats")
+    .def_readonly("hits", &blockCacheStats::hits)
+    .def_readonly("misses", &blockCacheStats::misses)
+    .def_readonly("evictions", &blockCacheStats::evictions)
+    .def_readonly("entries", &blockCacheStats::entries)
+    .def_readonly("bytes", &blockCacheStats::bytes)
+    .def_readonly("capacity", &blockCacheStats::capacity)
+    ;
+
+  py::class_<contactStats>(m, "contactStats")
+    .def_readonly("contacts", &contactStats::contacts)
+    .def_readonly("sum", &contactStats::sum)
+    .def_readonly("nonzeroBinsX", &contactStats::nonzeroBinsX)
+    .def_readonly("nonzeroBinsY", &contactStats::nonzeroBinsY)
+    ;
+
+  py::class_<chromosome>(m, "chromosome")
+    .def(py::init<>())
+    .def_readwrite("name", &chromosome::name)
+    .def_readwrite("index", &chromosome::index)
+    .def_readwrite("length", &chromosome::length)
+    ;
+
   py::class_<contactRecord>(m, "contactRecord")
     .def(py::init<>())
     .def_readwrite("binX", &contactRecord::binX)
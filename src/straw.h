@@ -25,9 +25,20 @@
 #define STRAW_H
 
 #include <fstream>
+#include <string>
 #include <set>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <deque>
+#include <curl/curl.h>
 
 // pointer structure for reading blocks or matrices, holds the size and position 
 struct indexEntry {
@@ -42,6 +53,44 @@ struct contactRecord {
   float counts;
 };
 
+// contacts of a query as three parallel arrays
+struct contactArrays {
+    std::vector<int> binX;
+    std::vector<int> binY;
+    std::vector<float> counts;
+};
+
+// block index of one resolution of a matrix, sorted by block number
+struct matrixZoomData {
+    float sumCounts;
+    int blockBinCount;
+    int blockColumnCount;
+    std::vector<int> blockNumbers;
+    std::vector<indexEntry> blockEntries;
+
+    bool findBlock(int blockNumber, indexEntry &entry) const;
+};
+
+// exact statistics of the contacts a query returns: how many, their total and how many distinct
+// positions they cover on each axis
+struct contactStats {
+    long contacts;
+    double sum;
+    long nonzeroBinsX;
+    long nonzeroBinsY;
+};
+
+// one resolution of a matrix, as listed in the matrix header
+struct zoomLevel {
+    std::string unit;
+    int binSize;
+    float sumCounts;
+    int blockBinCount;
+    int blockColumnCount;
+    int nBlocks;
+    long indexPosition; // file position of the block index
+};
+
 // chromosome
 struct chromosome {
     std::string name;
@@ -49,32 +98,514 @@ struct chromosome {
     long length;
 };
 
-bool readMagicString(std::ifstream &fin);
+// counters of the decoded block cache
+struct blockCacheStats {
+    long hits;
+    long misses;
+    long evictions;
+    long entries;
+    long bytes;
+    long capacity;
+};
+
+// bounded LRU cache of decoded blocks, shared by every HiCFile in the process. blocks are
+// keyed by file, matrix, zoom and block number; entries are evicted least recently used
+// first once their total size exceeds the capacity in bytes. all methods are thread-safe
+class BlockCache {
+public:
+    explicit BlockCache(long capacity);
+
+    std::shared_ptr<const std::vector<contactRecord> > get(const std::string &key);
+
+    void put(const std::string &key, std::shared_ptr<const std::vector<contactRecord> > block);
+
+    void setCapacity(long capacity);
+
+    void clear();
+
+    blockCacheStats getStats();
+
+private:
+    typedef std::pair<std::string, std::shared_ptr<const std::vector<contactRecord> > > cacheEntry;
+
+    std::mutex mutex;
+    // most recently used first
+    std::list<cacheEntry> lru;
+    std::unordered_map<std::string, std::list<cacheEntry>::iterator> entries;
+    long capacity;
+    long bytes;
+    long hits;
+    long misses;
+    long evictions;
+
+    static long entrySize(const cacheEntry &entry);
+
+    void evict();
+};
+
+// the process-wide block cache
+BlockCache &getBlockCache();
+
+// fixed-size pool of worker threads used to decode blocks in parallel
+class ThreadPool {
+public:
+    explicit ThreadPool(int nThreads);
+
+    ~ThreadPool();
+
+    int size() const { return (int) workers.size(); }
+
+    std::future<void> submit(std::function<void()> task);
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::packaged_task<void()> > tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping;
+
+    void work();
+};
+
+// the process-wide decoding pool; empty when decoding runs on the calling thread
+std::shared_ptr<ThreadPool> getThreadPool();
+
+// persistent cache of remote files, kept as fixed-size chunk files in one directory per URL and version
+// (its ETag, or Last-Modified). the least recently used chunks are deleted once the cache grows past
+// its capacity; chunks are written under a temporary name and renamed, so readers never see partial ones
+class RangeCache {
+public:
+    static const long chunkSize = 256 * 1024;
+
+    RangeCache(std::string directory, long capacity);
+
+    // reads a chunk of exactly size bytes into data; false if it is not cached
+    bool get(const std::string &key, long chunk, char *data, long size);
+
+    void put(const std::string &key, long chunk, const char *data, long size);
+
+private:
+    std::string directory;
+    long capacity;
+    long bytes;
+    std::mutex mutex;
+    // chunk file paths, most recently used first, with their sizes
+    std::list<std::pair<std::string, long> > lru;
+    std::unordered_map<std::string, std::list<std::pair<std::string, long> >::iterator> entries;
+
+    std::string chunkPath(const std::string &key, long chunk) const;
+
+    void load();
+
+    void evict();
+};
 
-std::map<std::string, chromosome> readHeader(std::istream &fin, long &masterIndexPosition);
+// the process-wide range cache; empty unless setHttpCacheDirectory was called
+std::shared_ptr<RangeCache> getRangeCache();
 
-bool readFooter(std::istream &fin, long master, int c1, int c2, std::string norm, std::string unit, int resolution,
-                long &myFilePos, indexEntry &c1NormEntry, indexEntry &c2NormEntry);
+// fetches byte ranges of one URL with the curl multi interface. up to getMaxHttpRequests() range
+// requests run at once, and finished handles (with their connections) are reused for later ones
+class HttpFetcher {
+public:
+    explicit HttpFetcher(std::string url);
 
-std::map<int, indexEntry>
-readMatrixZoomData(std::istream &fin, std::string myunit, int mybinsize, int &myBlockBinCount, int &myBlockColumnCount,
-                   bool &found);
+    ~HttpFetcher();
 
-std::map<int, indexEntry>
-readMatrix(std::istream &fin, int myFilePosition, std::string unit, int resolution, int &myBlockBinCount,
-           int &myBlockColumnCount);
+    bool isValid() const { return multi != NULL; }
 
-std::set<int>
-getBlockNumbersForRegionFromBinPosition(int *regionIndices, int blockBinCount, int blockColumnCount, bool intra);
+    // size of the resource from the Content-Range of the responses so far; 0 if not known yet
+    long getTotalBytes() const { return totalBytes; }
 
-std::vector<contactRecord> readBlock(std::istream &fin, int blockNumber);
+    // one buffer per range, each exactly entry.size bytes; empty for ranges that could not be fetched in full
+    std::vector<std::shared_ptr<char> > fetch(const std::vector<indexEntry> &ranges);
 
-std::vector<double> readNormalizationVector(std::istream &fin, indexEntry entry);
+    std::shared_ptr<char> fetch(long position, long size);
+
+private:
+    struct transfer;
+
+    std::string url;
+    CURLM *multi;
+    std::vector<CURL *> idle;
+    long totalBytes;
+    std::string etag;
+    std::string lastModified;
+    // identifies this version of the resource in the range cache; empty when it cannot be cached
+    std::string cacheKey;
+    bool validated;
+
+    HttpFetcher(const HttpFetcher &);
+
+    HttpFetcher &operator=(const HttpFetcher &);
+
+    CURL *getHandle();
+
+    void validate();
+
+    std::vector<std::shared_ptr<char> > fetchRanges(const std::vector<indexEntry> &ranges,
+                                                    std::vector<bool> &complete);
+
+    std::vector<std::shared_ptr<char> > fetchCached(RangeCache &cache, const std::vector<indexEntry> &ranges);
+
+    static size_t writeCallback(char *data, size_t size, size_t nmemb, void *userdata);
+
+    static size_t headerCallback(char *data, size_t size, size_t nitems, void *userdata);
+};
+
+class HiCFile;
+
+// reads the blocks of a query in order, keeping up to a window of them decoding ahead on the thread pool.
+// blocks already in the block cache are not read again
+class BlockReader {
+public:
+    BlockReader(HiCFile &file, int c1, int c2, std::string unit, int binsize, const std::set<int> &blockNumbers,
+                std::shared_ptr<const matrixZoomData> zoomData);
+
+    // waits for blocks still decoding, which may point into the file's memory mapping
+    ~BlockReader();
+
+    // the records of the next block; an empty pointer once all blocks have been read
+    std::shared_ptr<const std::vector<contactRecord> > next();
+
+    // same as next(), also setting the number of the block returned
+    std::shared_ptr<const std::vector<contactRecord> > next(int &blockNumber);
+
+    // whether reading stopped early because blocks could not be read
+    bool failed() const { return readFailed; }
+
+private:
+    // a block looked up in the cache, and read from the file if it was not there
+    struct fetchedBlock {
+        int blockNumber;
+        indexEntry idx;
+        std::string key;
+        std::shared_ptr<const std::vector<contactRecord> > cached;
+        std::shared_ptr<char> compressedBytes;
+    };
+
+    // a block waiting its turn; done is invalid for blocks found in the cache
+    struct pendingBlock {
+        int blockNumber;
+        std::future<void> done;
+        std::shared_ptr<std::shared_ptr<const std::vector<contactRecord> > > block;
+    };
+
+    HiCFile &file;
+    int c1;
+    int c2;
+    std::string unit;
+    int binsize;
+    std::set<int> blockNumbers;
+    std::set<int>::const_iterator nextBlock;
+    std::shared_ptr<const matrixZoomData> zoomData;
+    std::shared_ptr<ThreadPool> pool;
+    std::deque<fetchedBlock> fetched;
+    std::deque<pendingBlock> pending;
+    size_t maxPending;
+    size_t readAhead; // blocks read per fetch
+    bool readFailed;
+
+    BlockReader(const BlockReader &);
+
+    BlockReader &operator=(const BlockReader &);
+
+    void fetch();
+
+    void schedule(const fetchedBlock &fetchedBlock);
+};
+
+// turns contacts into observed/expected: divides them by the expected count at their distance from
+// the diagonal (intrachromosomal) or by the average count of the matrix (interchromosomal)
+struct expectedScale {
+    std::shared_ptr<const std::vector<double> > values; // by distance in bins; NULL for interchromosomal matrices
+    double normFactor; // of the chromosome; values are divided by it
+    double averageCount;
+    bool log; // natural log of observed/expected
+
+    float apply(int binX, int binY, float counts) const;
+};
+
+// where a query's contacts are, and how to scale them, to pick them out of whole blocks
+struct recordQuery {
+    int c1;
+    int c2;
+    int binsize;
+    long origRegionIndices[4]; // as given by user
+    // shared with the file's caches, so clearCache does not pull them from under a running query
+    std::shared_ptr<const std::vector<double> > c1Norm; // NULL when not normalizing
+    std::shared_ptr<const std::vector<double> > c2Norm;
+    bool overExpected; // observed/expected output, scaled by expected
+    expectedScale expected;
+    std::set<int> insideBlocks; // blocks with no contacts outside the region
+};
+
+// the contacts of a query, pulled block by block (see HiCFile::openRecordStream). only the blocks in
+// the read-ahead window are held in memory, plus whatever the block cache keeps
+class RecordStream {
+public:
+    // replaces chunk with the matching contacts of the next block that has any; false when there are no more
+    bool next(std::vector<contactRecord> &chunk);
+
+    bool next(contactArrays &chunk);
+
+    // whether the stream ended early because blocks could not be read
+    bool failed() const { return readFailed; }
+
+private:
+    friend class HiCFile;
+
+    recordQuery query;
+    std::unique_ptr<BlockReader> reader; // NULL when the query could not be run
+    bool readFailed;
+    std::mutex mutex; // one next() at a time
+
+    RecordStream() : readFailed(false) {}
+
+    template<class Records>
+    bool appendNext(Records &records);
+};
+
+// an expected value vector of the footer, with the per-chromosome normalization factors it is divided by
+struct expectedValues {
+    indexEntry entry; // where the values are
+    std::shared_ptr<const std::vector<double> > values; // read on first use; NULL until then
+    std::map<int, double> normFactors;
+};
+
+// a normalization vector, read a chunk of bins at a time as queries reach them; bins not read yet are NaN
+struct normVector {
+    std::vector<double> values;
+    // per chunk of bins, whether it has been read
+    std::vector<bool> loaded;
+};
+
+// .hic file opened once: the header, master index and normalization vector index are
+// read on construction and reused by every query
+class HiCFile {
+public:
+    explicit HiCFile(std::string fileName);
+
+    ~HiCFile();
+
+    bool isValid() const { return valid; }
+
+    int getVersion() const { return version; }
+
+    std::map<std::string, chromosome> getChromosomes() const { return chromosomeMap; }
+
+    // matrixType is "observed", "oe" (observed/expected) or "log_oe" (its natural log)
+    std::vector<contactRecord>
+    getRecords(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+               std::string matrixType = "observed");
+
+    contactArrays
+    getRecordArrays(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+                    std::string matrixType = "observed");
+
+    std::unique_ptr<RecordStream>
+    openRecordStream(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+                     std::string matrixType = "observed");
+
+    bool visitRecords(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+                      const std::function<bool(const std::vector<contactRecord> &)> &visit,
+                      std::string matrixType = "observed");
+
+    std::vector<std::vector<contactRecord> >
+    getRecordsBatch(std::string norm, const std::vector<std::pair<std::string, std::string> > &regions,
+                    std::string unit, int binsize, std::string matrixType = "observed");
+
+    std::vector<contactArrays>
+    getRecordArraysBatch(std::string norm, const std::vector<std::pair<std::string, std::string> > &regions,
+                         std::string unit, int binsize, std::string matrixType = "observed");
+
+    bool dumpGenome(std::string norm, std::string unit, int binsize,
+                    const std::function<bool(int, int, const std::vector<contactRecord> &)> &sink,
+                    std::string matrixType = "observed");
+
+    bool exportPixels(std::string norm, std::string unit, int binsize, std::string path,
+                      long memoryLimit = 256L * 1024 * 1024);
+
+    bool getMatrixShape(std::string chr1loc, std::string chr2loc, int binsize, long &nRows, long &nCols);
+
+    std::vector<int> getResolutions(std::string chr1, std::string chr2, std::string unit = "BP");
+
+    int pickResolution(std::string chr1loc, std::string chr2loc, std::string unit, long maxPixels,
+                       long maxContacts = 0);
+
+    std::vector<contactRecord>
+    getAggregatedRecords(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+                         std::string matrixType = "observed");
+
+    template<class T>
+    bool fillDenseMatrix(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+                         T *data, long nRows, long nCols, std::string matrixType = "observed");
+
+    std::vector<float> getDenseMatrix(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit,
+                                      int binsize, long &nRows, long &nCols, std::string matrixType = "observed");
+
+    contactStats getStats(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+                          std::string matrixType = "observed");
+
+    long getSize(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize);
+
+    bool writeBlockSummaries(std::string path, std::string unit, int binsize);
+
+    bool readBlockSummaries(std::string path);
+
+    void clearCache();
+
+private:
+    friend class BlockReader;
+
+    std::string fileName;
+    bool isHttp;
+    std::ifstream fin;
+    // local files are read through a read-only memory mapping when possible; NULL otherwise
+    char *mapped;
+    long mappedSize;
+    std::unique_ptr<HttpFetcher> http; // NULL for local files
+    int version;
+    long master;
+    long totalBytes;
+    bool valid;
+    std::map<std::string, chromosome> chromosomeMap;
+    // "c1_c2" to matrix position
+    std::unordered_map<std::string, indexEntry> masterIndex;
+    // getNormKey(norm, chrIdx, unit, resolution) to normalization vector position
+    std::unordered_map<std::string, indexEntry> normVectorIndex;
+    // "c1_c2" to the resolutions listed in that matrix's header, filled as queries need them
+    std::unordered_map<std::string, std::shared_ptr<const std::vector<zoomLevel> > > matrixResolutions;
+    // "c1_c2_unit_binsize" to the block index of that resolution, filled as queries need them
+    std::unordered_map<std::string, std::shared_ptr<const matrixZoomData> > zoomDataCache;
+    // getNormKey(norm, chrIdx, unit, resolution) to the normalization vector, filled as queries need them
+    std::unordered_map<std::string, std::shared_ptr<normVector> > normVectorCache;
+    // getExpectedKey(norm, unit, resolution) to the expected values of that normalization ("NONE" for raw
+    // counts), indexed on first use
+    std::unordered_map<std::string, expectedValues> expectedValueIndex;
+    bool expectedValuesIndexed;
+    // "c1_c2_unit_binsize" to the number of records of each block, from writeBlockSummaries or a sidecar
+    // file read with readBlockSummaries
+    std::map<std::string, std::map<int, int> > blockSummaries;
+    // held while the caches above, fin or http are used, so queries can run on one file from several threads
+    std::recursive_mutex fileMutex;
+
+    HiCFile(const HiCFile &);
+
+    HiCFile &operator=(const HiCFile &);
+
+    bool mapFile();
+
+    std::shared_ptr<char> readBytes(long position, long size);
+
+    bool readBlocks(const std::vector<indexEntry> &entries, std::vector<std::shared_ptr<char> > &blocks);
+
+    bool parseRegion(std::string chr1loc, std::string chr2loc, int binsize, int &c1, int &c2,
+                     long *origRegionIndices, long *regionIndices);
+
+    std::shared_ptr<const std::vector<double> > getNormVector(std::string norm, int chrIdx, std::string unit,
+                                                              int binsize, long firstBin, long lastBin);
+
+    std::shared_ptr<const std::vector<zoomLevel> > getMatrixResolutions(int c1, int c2);
+
+    std::shared_ptr<const matrixZoomData> getZoomData(int c1, int c2, std::string unit, int binsize);
+
+    void readExpectedValueIndex();
+
+    const expectedValues *getExpectedValues(std::string norm, std::string unit, int binsize);
+
+    bool prepareExpected(std::string matrixType, std::string norm, std::string unit, int binsize,
+                         const matrixZoomData &zoomData, recordQuery &query);
+
+    std::string getBlockKey(int c1, int c2, std::string unit, int binsize, int blockNumber);
+
+    long countBlockRecords(int c1, int c2, std::string unit, int binsize, const std::set<int> &blockNumbers,
+                           const matrixZoomData *zoomData);
+
+    template<class Records>
+    bool fillRecords(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+                     std::string matrixType, Records &records);
+
+    template<class Records>
+    void fillRecordsBatch(std::string norm, const std::vector<std::pair<std::string, std::string> > &regions,
+                          std::string unit, int binsize, std::string matrixType, std::vector<Records> &results);
+
+    bool prepareQuery(std::string norm, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+                      std::string matrixType, recordQuery &query, std::shared_ptr<const matrixZoomData> &zoomData,
+                      std::set<int> &blockNumbers);
+};
+
+bool readMagicString(std::istream &fin);
+
+std::map<std::string, chromosome> readHeader(std::istream &fin, long &masterIndexPosition, int &version);
+
+std::map<std::string, chromosome> readHeader(std::istream &fin, long &masterIndexPosition, int &version,
+                                             long &nviPosition, long &nviLength);
+
+std::string getNormKey(const std::string &norm, int chrIdx, const std::string &unit, int resolution);
+
+std::string getExpectedKey(const std::string &norm, const std::string &unit, int resolution);
+
+void skipExpectedValues(std::istream &fin, int version);
+
+bool readMasterIndex(std::istream &fin, int version, std::unordered_map<std::string, indexEntry> &masterIndex);
+
+bool readNormVectorIndex(std::istream &fin, int version, std::unordered_map<std::string, indexEntry> &normVectorIndex);
+
+bool readFooter(std::istream &fin, int version, std::unordered_map<std::string, indexEntry> &masterIndex,
+                std::unordered_map<std::string, indexEntry> &normVectorIndex);
+
+bool readMatrixResolutions(std::istream &fin, long myFilePosition, std::vector<zoomLevel> &levels);
+
+std::vector<contactRecord> decodeBlock(char *compressedBytes, long compressedSize, int version);
+
+int decodeSize(char *compressedBytes, long compressedSize);
+
+int inflatePrefix(const char *compressedBytes, long compressedSize, char *out, int size);
 
 std::vector<contactRecord>
-straw(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, std::string unit, int binsize);
+straw(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+      std::string matrixType = "observed");
+
+contactArrays
+strawArrays(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, std::string unit,
+            int binsize, std::string matrixType = "observed");
 
-int
+std::vector<std::vector<contactRecord> >
+strawBatch(std::string norm, std::string fname, const std::vector<std::pair<std::string, std::string> > &regions,
+           std::string unit, int binsize, std::string matrixType = "observed");
+
+bool dumpGenome(std::string norm, std::string fname, std::string unit, int binsize,
+                const std::function<bool(int, int, const std::vector<contactRecord> &)> &sink,
+                std::string matrixType = "observed");
+
+bool exportPixels(std::string norm, std::string fname, std::string unit, int binsize, std::string path,
+                  long memoryLimit = 256L * 1024 * 1024);
+
+long
 getSize(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, std::string unit, int binsize);
 
+contactStats
+getStats(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, std::string unit, int binsize,
+         std::string matrixType = "observed");
+
+void setBlockCacheCapacity(long capacity);
+
+void clearBlockCache();
+
+blockCacheStats getBlockCacheStats();
+
+void setNumThreads(int nThreads);
+
+int getNumThreads();
+
+void setMaxReadGap(long bytes);
+
+long getMaxReadGap();
+
+void setMaxHttpRequests(int requests);
+
+int getMaxHttpRequests();
+
+bool setHttpCacheDirectory(std::string directory, long capacity);
+
 #endif
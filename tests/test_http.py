@@ -0,0 +1,156 @@
+"""Reads a .hic file over HTTP and checks the results against reading it from disk.
+
+    python tests/test_http.py file.hic [norm]
+
+strawC must be built and installed first (pip install .). The file is served by local servers that
+honour Range requests, that ignore them and send the whole file with 200, and that fail range requests
+once the file is open: with an error status, or with bodies cut short. Failed requests must give
+empty results, never contacts decoded from an error page.
+"""
+import http.server
+import re
+import sys
+import threading
+
+import strawC
+
+STATUSES = [403, 404, 416, 500, 503]
+
+
+class RangeHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, *args):
+        pass
+
+    def do_HEAD(self):
+        self.do_GET(head=True)
+
+    def do_GET(self, head=False):
+        server = self.server
+        data = server.data
+        size = len(data)
+        match = re.match(r'bytes=(\d+)-(\d*)', self.headers.get('Range', ''))
+        if match and server.fail:
+            self.send_error_page(server.fail)
+            return
+        if match and not server.whole:
+            start = int(match.group(1))
+            end = min(int(match.group(2)) if match.group(2) else size - 1, size - 1)
+            if start >= size:
+                self.send_response(416)
+                self.send_header('Content-Range', 'bytes */%d' % size)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            body = data[start:end + 1]
+            if server.short and len(body) > 1:
+                body = body[:len(body) // 2]
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, start + len(body) - 1, size))
+        else:
+            body = data
+            self.send_response(200)
+        self.send_header('Content-Length', str(len(body)))
+        self.send_header('Accept-Ranges', 'none' if server.whole else 'bytes')
+        self.end_headers()
+        if not head:
+            self.wfile.write(body)
+
+    def send_error_page(self, status):
+        body = b'<html><body>error</body></html>' * 64
+        self.send_response(status)
+        self.send_header('Content-Type', 'text/html')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+def serve(path, whole=False):
+    """Starts a server for path on a free port; returns it and the URL of the file."""
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), RangeHandler)
+    server.daemon_threads = True
+    with open(path, 'rb') as f:
+        server.data = f.read()
+    server.whole = whole
+    server.fail = None
+    server.short = False
+    thread = threading.Thread(target=server.serve_forever)
+    thread.daemon = True
+    thread.start()
+    return server, 'http://127.0.0.1:%d/file.hic' % server.server_address[1]
+
+
+def pick_query(hic):
+    """The first matrix of two named chromosomes, at its coarsest BP resolution."""
+    names = sorted((c.index, name) for name, c in hic.getChromosomes().items() if name.lower() != 'all')
+    for i in range(len(names)):
+        for j in range(i, len(names)):
+            resolutions = hic.getResolutions(names[i][1], names[j][1], 'BP')
+            if resolutions:
+                return names[i][1], names[j][1], resolutions[-1]
+    raise SystemExit('no BP matrix in the file')
+
+
+def records(hic, norm, chr1, chr2, binsize):
+    return sorted((r.binX, r.binY, r.counts) for r in hic.getRecords(norm, chr1, chr2, 'BP', binsize))
+
+
+def check(name, ok):
+    print('%s %s' % ('ok  ' if ok else 'FAIL', name))
+    return ok
+
+
+def main():
+    if len(sys.argv) < 2:
+        raise SystemExit(__doc__)
+    path = sys.argv[1]
+    norm = sys.argv[2] if len(sys.argv) > 2 else 'NONE'
+    local = strawC.HiCFile(path)
+    chr1, chr2, binsize = pick_query(local)
+    expected = records(local, norm, chr1, chr2, binsize)
+    print('%s %s at %d: %d contacts' % (chr1, chr2, binsize, len(expected)))
+    passed = True
+
+    for whole in [False, True]:
+        server, url = serve(path, whole)
+        strawC.clearBlockCache()
+        remote = strawC.HiCFile(url)
+        label = 'server ignoring Range' if whole else 'range server'
+        passed &= check('%s: contacts match the local file' % label,
+                        remote.isValid() and records(remote, norm, chr1, chr2, binsize) == expected)
+        passed &= check('%s: strawC matches' % label,
+                        sorted((r.binX, r.binY, r.counts) for r in
+                               strawC.strawC(norm, url, chr1, chr2, 'BP', binsize)) == expected)
+        server.shutdown()
+
+    failures = [('status %d' % status, status, False) for status in STATUSES] + [('short bodies', None, True)]
+    for label, status, short in failures:
+        server, url = serve(path)
+        strawC.clearBlockCache()
+        remote = strawC.HiCFile(url)
+        # the block index and norm vectors are read while the server still answers; only blocks fail
+        remote.getSize(norm, chr1, chr2, 'BP', binsize)
+        server.fail = status
+        server.short = short
+        passed &= check('%s: getRecords is empty' % label, records(remote, norm, chr1, chr2, binsize) == [])
+        arrays = remote.getRecordsAsArrays(norm, chr1, chr2, 'BP', binsize)
+        passed &= check('%s: getRecordsAsArrays is empty' % label, all(len(a) == 0 for a in arrays))
+        passed &= check('%s: getSize is 0' % label, remote.getSize(norm, chr1, chr2, 'BP', binsize) == 0)
+        passed &= check('%s: getStats counts nothing' % label,
+                        remote.getStats(norm, chr1, chr2, 'BP', binsize).contacts == 0)
+        try:
+            for _ in remote.iterRecords(norm, chr1, chr2, 'BP', binsize):
+                pass
+            raised = False
+        except RuntimeError:
+            raised = True
+        passed &= check('%s: iterRecords raises' % label, raised)
+        passed &= check('%s: a new file is not valid' % label, not strawC.HiCFile(url).isValid())
+        server.shutdown()
+
+    sys.exit(0 if passed else 1)
+
+
+if __name__ == '__main__':
+    main()